@@ -112,6 +112,16 @@ int main(int argc, char **argv) {
     params.force_reset = true;
     params.log_zones = 3;
     params.gc_wmark = 1;
+    params.gc_soft_wmark = 2;
+    params.io_depth = 32;
+    params.merge_workers = 4;
+    params.log_summaries = true;
+    params.wear_level_threshold = 0;
+    params.read_cache_bytes = 0;
+    params.write_buffer_bytes = 0;
+    params.write_buffer_flush_us = 0;
+    params.seq_streams = 4;
+    params.meta_zones = 2;
 
     uint64_t max_num_lba_to_test = 0;
     printf("===================================================================================== \n");
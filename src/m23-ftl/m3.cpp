@@ -31,6 +31,7 @@ SOFTWARE.
 #include <iostream>
 #include <random>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "zns_device.h"
 #include "../common/utils.h"
@@ -195,11 +196,369 @@ static int wr_full_device_verify(struct user_zns_device *dev,
     return ret;
 }
 
+// the content of an LBA after its generation-th write, so a block from the wrong write or the wrong LBA shows up
+static void fill_generation(char *buf, uint32_t size, uint64_t lba, uint32_t generation){
+    uint64_t *words = (uint64_t *) buf;
+    for (uint32_t i = 0; i < size / sizeof(uint64_t); i++)
+        words[i] = ((lba << 32) | generation) * 0x9E3779B97F4A7C15ULL + i;
+}
+
+struct writer_args {
+    struct user_zns_device *dev;
+    uint32_t id;
+    uint32_t writers;
+    uint32_t max_lba;
+    uint32_t writes;
+    uint32_t *generation; // per LBA, each writer only touches the LBAs it owns
+    int ret;
+};
+
+static void *writer_thread(void *arg){
+    struct writer_args *args = (struct writer_args *) arg;
+    uint32_t lba_size = args->dev->lba_size_bytes;
+    char *buf = (char *) malloc(lba_size);
+    assert(buf != nullptr);
+    unsigned int seed = args->id + 1;
+    // writer id owns every LBA with lba % writers == id, so all writers spread over every logical zone
+    uint32_t owned = (args->max_lba - args->id + args->writers - 1) / args->writers;
+    args->ret = 0;
+    for (uint32_t i = 0; i < args->writes && args->ret == 0; i++){
+        uint64_t lba = (uint64_t) (rand_r(&seed) % owned) * args->writers + args->id;
+        fill_generation(buf, lba_size, lba, ++args->generation[lba]);
+        args->ret = zns_udevice_write(args->dev, lba * lba_size, buf, lba_size);
+        if(args->ret != 0){
+            printf("Error: ZNS device writing failed at offset 0x%lx by writer %u, ret %d \n", lba * lba_size, args->id, args->ret);
+        }
+    }
+    free(buf);
+    return nullptr;
+}
+
+/*
+ * Several threads overwrite random LBAs at once, so their appends race on the log heads (and with log lanes on, run
+ * on different open log zones) while the gc merges behind them. Every LBA a writer touched must read back its last
+ * write.
+ */
+static int concurrent_writers_verify(struct user_zns_device *dev, uint32_t max_lba, uint32_t writers, uint32_t writes){
+    int ret = 0;
+    uint32_t *generation = (uint32_t *) calloc(max_lba, sizeof(uint32_t));
+    char *b1 = (char *) malloc(dev->lba_size_bytes);
+    char *b2 = (char *) malloc(dev->lba_size_bytes);
+    assert(generation != nullptr && b1 != nullptr && b2 != nullptr);
+    std::vector<pthread_t> threads(writers);
+    std::vector<struct writer_args> args(writers);
+    for(uint32_t i = 0; i < writers; i++){
+        args[i] = {dev, i, writers, max_lba, writes / writers, generation, 0};
+        ret = pthread_create(&threads[i], nullptr, writer_thread, &args[i]);
+        assert(ret == 0);
+    }
+    for(uint32_t i = 0; i < writers; i++){
+        pthread_join(threads[i], nullptr);
+        if(args[i].ret != 0)
+            ret = args[i].ret;
+    }
+    if(ret != 0)
+        goto done;
+    printf("%u writers wrote %u LBAs OK, verifying ....\n", writers, writes);
+    for(uint64_t lba = 0; lba < max_lba; lba++){
+        if(generation[lba] == 0)
+            continue;
+        ret = zns_udevice_read(dev, lba * dev->lba_size_bytes, b1, dev->lba_size_bytes);
+        if(ret != 0){
+            printf("Error: ZNS device reading failed at offset 0x%lx, ret %d \n", lba * dev->lba_size_bytes, ret);
+            goto done;
+        }
+        fill_generation(b2, dev->lba_size_bytes, lba, generation[lba]);
+        if(memcmp(b1, b2, dev->lba_size_bytes) != 0){
+            printf("ERROR: buffer mismatch at LBA %lu, expecting write %u \n", lba, generation[lba]);
+            ret = -EINVAL;
+            goto done;
+        }
+    }
+    printf("Verification passed for the concurrent writers \n");
+
+    done:
+    free(generation);
+    free(b1);
+    free(b2);
+    return ret;
+}
+
+struct async_tracker {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    uint32_t completed;
+};
+
+struct async_request {
+    struct async_tracker *tracker;
+    uint64_t lba; // first LBA of the request
+    char *buf;
+    uint32_t generation; // of the write, or the one a read expects
+    int status;
+    int calls;
+};
+
+static void async_request_done(void *ctx, int status){
+    struct async_request *req = (struct async_request *) ctx;
+    pthread_mutex_lock(&req->tracker->lock);
+    req->status = status;
+    req->calls++;
+    req->tracker->completed++;
+    pthread_cond_signal(&req->tracker->done);
+    pthread_mutex_unlock(&req->tracker->lock);
+}
+
+static void fill_blocks(char *buf, uint32_t lba_size, uint64_t lba, uint32_t blocks, uint32_t generation){
+    for (uint32_t i = 0; i < blocks; i++)
+        fill_generation(buf + (uint64_t) i * lba_size, lba_size, lba + i, generation);
+}
+
+/*
+ * Queues io_depth requests of `blocks` LBAs at once, each on its own stretch of the device, and waits for their
+ * callbacks: first all writes, then half of them read back while the other half is overwritten, then all of them read
+ * back. Every callback must come exactly once with a status of 0, every read must find the last write.
+ */
+static int async_verify(struct user_zns_device *dev, uint32_t max_lba, uint32_t depth, uint32_t blocks){
+    int ret = 0;
+    uint32_t lba_size = dev->lba_size_bytes, stride = max_lba / depth;
+    assert(stride >= blocks);
+    struct async_tracker tracker;
+    pthread_mutex_init(&tracker.lock, nullptr);
+    pthread_cond_init(&tracker.done, nullptr);
+    std::vector<struct async_request> reqs(depth);
+    std::vector<uint32_t> written(depth, 0);
+    char *expected = (char *) malloc((uint64_t) blocks * lba_size);
+    assert(expected != nullptr);
+    for(uint32_t i = 0; i < depth; i++){
+        reqs[i].buf = (char *) malloc((uint64_t) blocks * lba_size);
+        assert(reqs[i].buf != nullptr);
+    }
+    // round 0 writes everything, round 1 reads the first half and overwrites the second, round 2 reads everything
+    for(int round = 0; round < 3 && ret == 0; round++){
+        tracker.completed = 0;
+        for(uint32_t i = 0; i < depth; i++){
+            struct async_request *req = &reqs[i];
+            bool write = round == 0 || (round == 1 && i >= depth / 2);
+            req->tracker = &tracker;
+            req->lba = (uint64_t) i * stride;
+            req->status = -1;
+            req->calls = 0;
+            if(write){
+                req->generation = ++written[i];
+                fill_blocks(req->buf, lba_size, req->lba, blocks, req->generation);
+                ret = zns_udevice_write_async(dev, req->lba * lba_size, req->buf, blocks * lba_size, async_request_done, req);
+            } else {
+                req->generation = written[i];
+                memset(req->buf, 0, (uint64_t) blocks * lba_size);
+                ret = zns_udevice_read_async(dev, req->lba * lba_size, req->buf, blocks * lba_size, async_request_done, req);
+            }
+            if(ret != 0){
+                printf("Error: queueing the async %s at offset 0x%lx failed, ret %d \n", write ? "write" : "read", req->lba * lba_size, ret);
+                // the requests queued so far still complete
+                depth = i;
+                break;
+            }
+        }
+        pthread_mutex_lock(&tracker.lock);
+        while (tracker.completed < depth)
+            pthread_cond_wait(&tracker.done, &tracker.lock);
+        pthread_mutex_unlock(&tracker.lock);
+        for(uint32_t i = 0; i < depth && ret == 0; i++){
+            struct async_request *req = &reqs[i];
+            if(req->calls != 1 || req->status != 0){
+                printf("ERROR: async request at offset 0x%lx completed %d times with status %d \n", req->lba * lba_size, req->calls, req->status);
+                ret = -EINVAL;
+                break;
+            }
+            bool read = round == 2 || (round == 1 && i < depth / 2);
+            if(!read)
+                continue;
+            fill_blocks(expected, lba_size, req->lba, blocks, req->generation);
+            if(memcmp(req->buf, expected, (uint64_t) blocks * lba_size) != 0){
+                printf("ERROR: async read mismatch at offset 0x%lx, expecting write %u \n", req->lba * lba_size, req->generation);
+                ret = -EINVAL;
+            }
+        }
+    }
+    if(ret == 0)
+        printf("Verification passed for %u async requests in flight \n", depth);
+    for(uint32_t i = 0; i < reqs.size(); i++)
+        free(reqs[i].buf);
+    free(expected);
+    pthread_mutex_destroy(&tracker.lock);
+    pthread_cond_destroy(&tracker.done);
+    return ret;
+}
+
+// compares size bytes read at lba against the generations the test wrote last, LBAs it did not write are skipped
+static int check_blocks(const char *buf, uint32_t lba_size, uint64_t lba, uint32_t blocks, const std::vector<uint32_t> &model, char *expected){
+    for (uint32_t i = 0; i < blocks; i++){
+        if (model[lba + i] == 0)
+            continue;
+        fill_generation(expected, lba_size, lba + i, model[lba + i]);
+        if (memcmp(buf + (uint64_t) i * lba_size, expected, lba_size) != 0){
+            printf("ERROR: buffer mismatch at LBA %lu, expecting write 0x%x \n", lba + i, model[lba + i]);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Vectored writes mix scattered elements with elements that overlap an earlier one of the same request, where the
+ * later element has to win. Every request is read back through readv element by element, at the end the whole device
+ * is read through readv in runs of adjacent LBAs into one buffer. Both are compared against a model of the device.
+ */
+static int vector_verify(struct user_zns_device *dev, uint32_t max_lba, uint32_t rounds){
+    int ret = 0;
+    const int elements = 16;
+    const uint32_t max_blocks = 4, run = 16;
+    uint32_t lba_size = dev->lba_size_bytes, next_generation = 0;
+    unsigned int seed = 1;
+    // the generation each LBA was written with last, 0 if this test did not write it. Generations have the top bit
+    // set so the blocks of the other tests never match them.
+    std::vector<uint32_t> model(max_lba, 0);
+    struct zns_iovec iov[elements];
+    uint32_t generation[elements];
+    char *wbufs = (char *) malloc((uint64_t) elements * max_blocks * lba_size);
+    char *rbufs = (char *) malloc((uint64_t) elements * run * lba_size);
+    char *expected = (char *) malloc(lba_size);
+    assert(wbufs != nullptr && rbufs != nullptr && expected != nullptr);
+
+    for(uint32_t round = 0; round < rounds && ret == 0; round++){
+        for(int e = 0; e < elements; e++){
+            uint64_t lba;
+            uint32_t blocks = 1 + rand_r(&seed) % max_blocks;
+            if(e > 0 && rand_r(&seed) % 4 == 0){
+                // start inside an earlier element
+                const struct zns_iovec *prev = &iov[rand_r(&seed) % e];
+                lba = prev->address / lba_size + rand_r(&seed) % (prev->size / lba_size);
+                blocks = std::min(blocks, (uint32_t) (max_lba - lba));
+            } else {
+                lba = rand_r(&seed) % (max_lba - max_blocks + 1);
+            }
+            generation[e] = (1u << 31) | ++next_generation;
+            iov[e].address = lba * lba_size;
+            iov[e].buffer = wbufs + (uint64_t) e * max_blocks * lba_size;
+            iov[e].size = blocks * lba_size;
+            fill_blocks((char *) iov[e].buffer, lba_size, lba, blocks, generation[e]);
+        }
+        ret = zns_udevice_writev(dev, iov, elements);
+        if(ret != 0){
+            printf("Error: ZNS device vectored writing failed in round %u, ret %d \n", round, ret);
+            break;
+        }
+        for(int e = 0; e < elements; e++){
+            for(uint32_t i = 0; i < iov[e].size / lba_size; i++)
+                model[iov[e].address / lba_size + i] = generation[e];
+            iov[e].buffer = rbufs + (uint64_t) e * max_blocks * lba_size;
+        }
+        ret = zns_udevice_readv(dev, iov, elements);
+        if(ret != 0){
+            printf("Error: ZNS device vectored reading failed in round %u, ret %d \n", round, ret);
+            break;
+        }
+        for(int e = 0; e < elements && ret == 0; e++)
+            ret = check_blocks((char *) iov[e].buffer, lba_size, iov[e].address / lba_size, iov[e].size / lba_size, model, expected);
+    }
+    printf("%u vectored writes of %d elements read back element by element %s \n", rounds, elements, ret == 0 ? "OK" : "FAILED");
+
+    // adjacent elements land in adjacent parts of one buffer, so the FTL may read them with one command
+    for(uint64_t lba = 0; lba < max_lba && ret == 0; lba += (uint64_t) elements * run){
+        int count = 0;
+        for(; count < elements && lba + (uint64_t) count * run < max_lba; count++){
+            iov[count].address = (lba + (uint64_t) count * run) * lba_size;
+            iov[count].buffer = rbufs + (uint64_t) count * run * lba_size;
+            iov[count].size = std::min((uint64_t) run, max_lba - (lba + (uint64_t) count * run)) * lba_size;
+        }
+        ret = zns_udevice_readv(dev, iov, count);
+        if(ret != 0){
+            printf("Error: ZNS device vectored reading failed at offset 0x%lx, ret %d \n", lba * lba_size, ret);
+            break;
+        }
+        uint32_t blocks = 0;
+        for(int e = 0; e < count; e++)
+            blocks += iov[e].size / lba_size;
+        ret = check_blocks(rbufs, lba_size, lba, blocks, model, expected);
+    }
+    if(ret == 0)
+        printf("Verification passed for the vectored writes and reads \n");
+    free(wbufs);
+    free(rbufs);
+    free(expected);
+    return ret;
+}
+
+/*
+ * Small writes land in the write buffer, the flush has to make them durable. The device is then unmounted and mounted
+ * again without a reset, every LBA must read back its last write.
+ */
+static int flush_remount_verify(struct user_zns_device **dev, struct zdev_init_params *params, uint32_t max_lba, uint32_t writes){
+    int ret = 0;
+    uint32_t lba_size = (*dev)->lba_size_bytes;
+    unsigned int seed = 7;
+    // generations with the second highest bit set, apart from the ones of the earlier tests
+    std::vector<uint32_t> model(max_lba, 0);
+    char *buf = (char *) malloc(lba_size);
+    char *expected = (char *) malloc(lba_size);
+    assert(buf != nullptr && expected != nullptr);
+    for(uint32_t i = 0; i < writes; i++){
+        uint64_t lba = rand_r(&seed) % max_lba;
+        model[lba] = (1u << 30) | (i + 1);
+        fill_generation(buf, lba_size, lba, model[lba]);
+        ret = zns_udevice_write(*dev, lba * lba_size, buf, lba_size);
+        if(ret != 0){
+            printf("Error: ZNS device writing failed at offset 0x%lx, ret %d \n", lba * lba_size, ret);
+            goto done;
+        }
+    }
+    ret = zns_udevice_flush(*dev);
+    // nothing is left to flush the second time
+    if(ret == 0)
+        ret = zns_udevice_flush(*dev);
+    if(ret != 0){
+        printf("Error: ZNS device flush failed, ret %d \n", ret);
+        goto done;
+    }
+    printf("%u buffered writes flushed OK, remounting ....\n", writes);
+    ret = deinit_ss_zns_device(*dev);
+    *dev = nullptr;
+    if(ret != 0){
+        printf("Error: unmounting the ZNS device failed, ret %d \n", ret);
+        goto done;
+    }
+    params->force_reset = false;
+    ret = init_ss_zns_device(params, dev);
+    if(ret != 0){
+        printf("Error: mounting the ZNS device again failed, ret %d \n", ret);
+        *dev = nullptr;
+        goto done;
+    }
+    for(uint64_t lba = 0; lba < max_lba && ret == 0; lba++){
+        if(model[lba] == 0)
+            continue;
+        ret = zns_udevice_read(*dev, lba * lba_size, buf, lba_size);
+        if(ret != 0){
+            printf("Error: ZNS device reading failed at offset 0x%lx, ret %d \n", lba * lba_size, ret);
+            break;
+        }
+        ret = check_blocks(buf, lba_size, lba, 1, model, expected);
+    }
+    if(ret == 0)
+        printf("Verification passed after the flush and the remount \n");
+
+    done:
+    free(buf);
+    free(expected);
+    return ret;
+}
+
 static int show_help(){
     printf("Usage: m2 -d device_name -h -r \n");
     printf("-d : /dev/nvmeXpY - in this format with the full path \n");
     printf("-r : resume if the FTL can. \n");
-    printf("-l : the number of zones to use for log/metadata (default, minimum = 3). \n");
+    printf("-l : the number of zones to use for log/metadata (default 6, minimum = 3). \n");
     printf("-w : watermark threshold, the number of free zones when to trigger the gc (default, minimum = 1). \n");
     printf("-o : overwrite so [int] times  (default, 10,000). \n");
     printf("-h : shows help, and exits with success. No argument needed\n");
@@ -218,8 +577,20 @@ int main(int argc, char **argv) {
 
     struct zdev_init_params params;
     params.force_reset = true;
-    params.log_zones = 3;
+    params.log_zones = 6;
     params.gc_wmark = 1;
+    params.gc_soft_wmark = 2;
+    params.io_depth = 32;
+    params.merge_workers = 4;
+    params.log_summaries = true;
+    params.wear_level_threshold = 0;
+    params.hot_cold_streams = true;
+    params.log_lanes = 2;
+    params.read_cache_bytes = 16 << 20;
+    params.write_buffer_bytes = 1 << 20;
+    params.write_buffer_flush_us = 1000;
+    params.seq_streams = 4;
+    params.meta_zones = 2;
 
     printf("===================================================================================== \n");
     printf("This is M3. The goal of this milestone is to implement a hybrid log-structure ZTL (Zone Translation Layer) on top of the ZNS WITH a GC \n");
@@ -290,8 +661,17 @@ int main(int argc, char **argv) {
     int t1 = wr_full_device_verify(my_dev, seq_addresses, max_lba_entries, 0);
     int t2 = wr_full_device_verify(my_dev, random_addresses, max_lba_entries, 0);
     int t3 = wr_full_device_verify(my_dev, random_addresses, max_lba_entries, to_hammer_lba);
-    // clean up
-    ret = deinit_ss_zns_device(my_dev);
+    int t4 = concurrent_writers_verify(my_dev, max_lba_entries, 4, to_hammer_lba);
+    int t5 = async_verify(my_dev, max_lba_entries, params.io_depth, 4);
+    int t6 = vector_verify(my_dev, max_lba_entries, 1000);
+    struct zns_udevice_stats stats;
+    zns_udevice_get_stats(my_dev, &stats);
+    struct zns_latency_stats latency[ZNS_LAT_OPS];
+    zns_udevice_get_latency(my_dev, latency, false);
+    // remounts the device, so it runs after the statistics are taken
+    int t7 = flush_remount_verify(&my_dev, &params, max_lba_entries, 256);
+    // clean up, unless the remount failed
+    ret = my_dev != nullptr ? deinit_ss_zns_device(my_dev) : t7;
     // free all
     delete[] seq_addresses;
     delete[] random_addresses;
@@ -301,8 +681,31 @@ int main(int argc, char **argv) {
     printf("[stosys-result] Test 1 sequential write, read, and match (full device)                : %s \n", (t1 == 0 ? " Passed" : " Failed"));
     printf("[stosys-result] Test 2 randomized write, read, and match (full device)                : %s \n", (t2 == 0 ? " Passed" : " Failed"));
     printf("[stosys-result] Test 3 randomized write, read, and match (full device, hammer %-6u)   : %s \n", to_hammer_lba, (t3 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 4 concurrent writers, read, and match (4 writers, %-6u writes)   : %s \n", to_hammer_lba, (t4 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 5 async write, read, and match (%-3d requests in flight)            : %s \n", params.io_depth, (t5 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 6 vectored write, read, and match (overlapping, scattered elements): %s \n", (t6 == 0 ? " Passed" : " Failed"));
+    printf("[stosys-result] Test 7 buffered write, flush, remount, read, and match                  : %s \n", (t7 == 0 ? " Passed" : " Failed"));
     printf("====================================================================\n");
     printf("[stosys-stats] The elapsed time is %lu milliseconds \n", ((end -  start)/1000));
+    printf("[stosys-stats] host bytes written %lu read %lu, device bytes written %lu (simple copy %lu) read %lu, write amplification %.2f \n",
+           stats.host_bytes_written, stats.host_bytes_read, stats.device_bytes_written, stats.copy_bytes_written,
+           stats.device_bytes_read, stats.host_bytes_written ? (double)stats.device_bytes_written / stats.host_bytes_written : 0.0);
+    printf("[stosys-stats] merges switch %lu partial %lu full %lu, wear leveling moves %lu, zone resets %lu closes %lu finishes %lu \n",
+           stats.switch_merges, stats.partial_merges, stats.full_merges, stats.wear_level_moves, stats.zone_resets,
+           stats.zone_closes, stats.zone_finishes);
+    printf("[stosys-stats] gc invocations %lu, gc pause total %lu us max %lu us, writers blocked %lu us \n",
+           stats.gc_invocations, stats.gc_pause_ns / 1000, stats.gc_pause_max_ns / 1000, stats.writer_block_ns / 1000);
+    printf("[stosys-stats] zones free %u dirty %u, log zones %u free %u, data zones %u \n",
+           stats.free_zones, stats.dirty_zones, stats.log_zones, stats.free_log_zones, stats.data_zones);
+    printf("[stosys-stats] read cache hits %lu misses %lu, write buffer flushes %lu absorbed %lu, sequential bytes %lu \n",
+           stats.cache_hits, stats.cache_misses, stats.write_buffer_flushes, stats.write_buffer_absorbed,
+           stats.seq_bytes_written);
+    const char *latency_names[ZNS_LAT_OPS] = {"read", "write", "merge", "reset", "meta"};
+    for (int i = 0; i < ZNS_LAT_OPS; i++) {
+        printf("[stosys-stats] %-5s latency count %lu p50 %.1f us p99 %.1f us p99.9 %.1f us max %.1f us \n", latency_names[i],
+               latency[i].count, latency[i].p50_ns / 1000.0, latency[i].p99_ns / 1000.0, latency[i].p999_ns / 1000.0,
+               latency[i].max_ns / 1000.0);
+    }
     printf("====================================================================\n");
     return ret;
 }
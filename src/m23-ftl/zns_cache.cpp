@@ -0,0 +1,182 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "zns_cache.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <unordered_map>
+
+#define SS_CACHE_SHARDS 16
+#define SS_CACHE_EMPTY UINT64_MAX
+
+extern "C"
+{
+    struct ss_cache_shard
+    {
+        pthread_mutex_t mutex;
+        std::unordered_map<uint64_t, uint32_t> index; // block to slot
+        uint64_t *blocks;                             // block in each slot, SS_CACHE_EMPTY if none
+        uint8_t *referenced;                          // CLOCK reference bits
+        char *data;
+        uint32_t slots;
+        uint32_t hand;
+        uint64_t generation; // bumped by every invalidation that hits the shard
+        uint64_t hits;
+        uint64_t misses;
+    };
+
+    struct ss_cache
+    {
+        uint32_t block_size;
+        uint32_t shard_num;
+        struct ss_cache_shard shards[SS_CACHE_SHARDS];
+    };
+
+    static struct ss_cache_shard *cache_shard(struct ss_cache *cache, uint64_t block)
+    {
+        return &cache->shards[block % cache->shard_num];
+    }
+
+    int ss_cache_init(struct ss_cache **cache, uint64_t bytes, uint32_t block_size)
+    {
+        uint64_t blocks = bytes / block_size;
+        if (!blocks)
+            return -EINVAL;
+        struct ss_cache *c = new ss_cache();
+        c->block_size = block_size;
+        c->shard_num = blocks < SS_CACHE_SHARDS ? blocks : SS_CACHE_SHARDS;
+        for (uint32_t i = 0; i < c->shard_num; i++)
+        {
+            struct ss_cache_shard *shard = &c->shards[i];
+            pthread_mutex_init(&shard->mutex, NULL);
+            shard->slots = blocks / c->shard_num;
+            shard->blocks = (uint64_t *)malloc(shard->slots * sizeof(uint64_t));
+            shard->referenced = (uint8_t *)calloc(shard->slots, sizeof(uint8_t));
+            shard->data = (char *)malloc((uint64_t)shard->slots * block_size);
+            if (!shard->blocks || !shard->referenced || !shard->data)
+            {
+                c->shard_num = i + 1;
+                ss_cache_destroy(c);
+                return -ENOMEM;
+            }
+            memset(shard->blocks, 0xff, shard->slots * sizeof(uint64_t));
+            shard->index.reserve(shard->slots);
+        }
+        *cache = c;
+        return 0;
+    }
+
+    bool ss_cache_lookup(struct ss_cache *cache, uint64_t block, void *buffer, uint64_t *token)
+    {
+        struct ss_cache_shard *shard = cache_shard(cache, block);
+        pthread_mutex_lock(&shard->mutex);
+        auto iter = shard->index.find(block);
+        bool hit = iter != shard->index.end();
+        if (hit)
+        {
+            memcpy(buffer, shard->data + (uint64_t)iter->second * cache->block_size, cache->block_size);
+            shard->referenced[iter->second] = 1;
+            shard->hits++;
+        }
+        else
+        {
+            *token = shard->generation;
+            shard->misses++;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+        return hit;
+    }
+
+    void ss_cache_fill(struct ss_cache *cache, uint64_t block, const void *data, uint64_t token)
+    {
+        struct ss_cache_shard *shard = cache_shard(cache, block);
+        pthread_mutex_lock(&shard->mutex);
+        if (token != shard->generation || shard->index.count(block))
+        {
+            pthread_mutex_unlock(&shard->mutex);
+            return;
+        }
+        // CLOCK: the hand clears reference bits until it finds a slot that was not used since its last round
+        uint32_t slot;
+        while (1)
+        {
+            slot = shard->hand;
+            shard->hand = (shard->hand + 1) % shard->slots;
+            if (shard->blocks[slot] == SS_CACHE_EMPTY || !shard->referenced[slot])
+                break;
+            shard->referenced[slot] = 0;
+        }
+        if (shard->blocks[slot] != SS_CACHE_EMPTY)
+            shard->index.erase(shard->blocks[slot]);
+        shard->blocks[slot] = block;
+        shard->referenced[slot] = 0;
+        shard->index[block] = slot;
+        memcpy(shard->data + (uint64_t)slot * cache->block_size, data, cache->block_size);
+        pthread_mutex_unlock(&shard->mutex);
+    }
+
+    void ss_cache_invalidate(struct ss_cache *cache, uint64_t block, uint64_t count)
+    {
+        for (uint32_t i = 0; i < cache->shard_num && i < count; i++)
+        {
+            struct ss_cache_shard *shard = cache_shard(cache, block + i);
+            pthread_mutex_lock(&shard->mutex);
+            shard->generation++;
+            for (uint64_t b = block + i; b < block + count && !shard->index.empty(); b += cache->shard_num)
+            {
+                auto iter = shard->index.find(b);
+                if (iter == shard->index.end())
+                    continue;
+                shard->blocks[iter->second] = SS_CACHE_EMPTY;
+                shard->index.erase(iter);
+            }
+            pthread_mutex_unlock(&shard->mutex);
+        }
+    }
+
+    void ss_cache_counters(struct ss_cache *cache, uint64_t *hits, uint64_t *misses)
+    {
+        *hits = *misses = 0;
+        for (uint32_t i = 0; i < cache->shard_num; i++)
+        {
+            pthread_mutex_lock(&cache->shards[i].mutex);
+            *hits += cache->shards[i].hits;
+            *misses += cache->shards[i].misses;
+            pthread_mutex_unlock(&cache->shards[i].mutex);
+        }
+    }
+
+    void ss_cache_destroy(struct ss_cache *cache)
+    {
+        for (uint32_t i = 0; i < cache->shard_num; i++)
+        {
+            struct ss_cache_shard *shard = &cache->shards[i];
+            pthread_mutex_destroy(&shard->mutex);
+            free(shard->blocks);
+            free(shard->referenced);
+            free(shard->data);
+        }
+        delete cache;
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_CACHE_H
+#define STOSYS_PROJECT_ZNS_CACHE_H
+
+#include <cstdint>
+
+extern "C"
+{
+    struct ss_cache;
+
+    // Block cache in DRAM with CLOCK eviction, split into shards by block number that each have their own lock. A
+    // miss hands out a token, the shard generation, and a fill with that token is dropped if the block was
+    // invalidated since, so a read racing with a write never caches the data the write replaced.
+    int ss_cache_init(struct ss_cache **cache, uint64_t bytes, uint32_t block_size);
+    // copies a cached block into buffer and returns true, otherwise returns false with the token for its fill
+    bool ss_cache_lookup(struct ss_cache *cache, uint64_t block, void *buffer, uint64_t *token);
+    void ss_cache_fill(struct ss_cache *cache, uint64_t block, const void *data, uint64_t token);
+    // drops count blocks from block on, taking every shard lock at most once
+    void ss_cache_invalidate(struct ss_cache *cache, uint64_t block, uint64_t count);
+    void ss_cache_counters(struct ss_cache *cache, uint64_t *hits, uint64_t *misses);
+    void ss_cache_destroy(struct ss_cache *cache);
+}
+
+#endif //STOSYS_PROJECT_ZNS_CACHE_H
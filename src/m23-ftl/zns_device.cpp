@@ -21,9 +21,19 @@ SOFTWARE.
  */
 
 #include "zns_device.h"
+#include "zns_cache.h"
+#include "zns_io_engine.h"
+#include "zns_latency.h"
+#include "zns_meta.h"
+#include "zns_zones.h"
 #include "libnvme.h"
 #include <cerrno>
-#include <unordered_map>
+#include <sched.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
 #include <string.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -33,25 +43,460 @@ extern "C"
 {
 
 #define ENTRY_INVALID (1L << 63)
-#define address_2_zone(addr) ((addr) / (zns_dev_ex->blocks_per_zone * zns_dev->lba_size_bytes)) + zns_dev_ex->log_zone_num_config
+#define MAP_INVALID UINT32_MAX
+#define address_2_zone(addr) ((addr) / (zns_dev_ex->blocks_per_zone * zns_dev->lba_size_bytes))
 #define address_2_offset(addr) ((addr) % (zns_dev_ex->blocks_per_zone * zns_dev->lba_size_bytes) / zns_dev->lba_size_bytes)
-#define zone_2_address(zone_no) (zone_no - zns_dev_ex->log_zone_num_config) * (zns_dev_ex->blocks_per_zone * zns_dev->lba_size_bytes)
-#define map_contains(map, key) (map.find(key) != map.end())
+#define zone_2_address(zone_no) ((zone_no) * (zns_dev_ex->blocks_per_zone * zns_dev->lba_size_bytes))
 #define EMPTY 1
+#define OPEN 2
 #define FULL 14
 #define MDTS (64 * 4096)
+#define DEFAULT_IO_DEPTH 32
+#define META_ZONES_DEFAULT 2
+#define LOG_SUMMARY_MAGIC 0x59524d53
+#define META_CKPT_LOG_SUMMARIES (1 << 0)
+#define META_CHUNK_BYTES 4096
+#define META_VARINT_MAX 5 // bytes of a varint holding up to 35 bits
+#define WEAR_LEVEL_IDLE_MS 1000
+#define LOG_STREAMS_MAX 2
+#define LOG_LANES_MAX 8
+#define LOG_HEADS_MAX (LOG_STREAMS_MAX * LOG_LANES_MAX)
+#define LOG_HOT_VICTIM_BIAS 4 // cost-benefit weight of sealed hot log zones
+#define READ_EPOCH_SLOTS 64
+#define SEQ_STREAMS_MAX 8
+#define ONCS_SIMPLE_COPY (1 << 8)
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
 #define roundup(x, y) (                  \
     {                                    \
         typeof(y) __y = y;               \
         (((x) + (__y - 1)) / __y) * __y; \
     })
 
-    std::unordered_map<int64_t, int64_t> log_mapping;
-    std::unordered_map<int64_t, int64_t> data_mapping;
+    // Two-level log table indexed by logical zone. A leaf holds one 32-bit physical LBA per block of the zone
+    // (MAP_INVALID if the block has no log copy) and is only allocated while the zone has log entries,
+    // so a null leaf doubles as the per-zone "has log entries" bit and data-zone reads skip the log lookup.
+    uint32_t **log_mapping;
+    uint32_t *log_mapping_count;
+    // Writers map their appends under map_mutex rather than gc_mutex. It guards the leaves and their counts, the
+    // per-slot accounting and the heat of the log streams. Code under gc_mutex takes it after gc_mutex to read them,
+    // and to move log slots between zones.
+    pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+    // physical start LBA of the data zone backing each logical zone, MAP_INVALID if it was never merged
+    uint32_t *data_mapping;
+    // blocks of the data zone that hold data, the whole zone once it was merged and 0 without one. Only the zone of a
+    // sequential stream is in between, reads past its end find nothing.
+    uint32_t *data_written;
+    uint64_t logical_zone_num;
+
+    // Log zone bookkeeping for the incremental gc, indexed by log slot. A switch merge turns a log zone into a data
+    // zone and hands the old data zone to the log, so log_zone_phys / zone_log_slot translate between the
+    // log_zone_num_config slots and physical zones (-1 for zones that are not in the log). log_reverse maps every
+    // log block back to the user LBA it holds (MAP_INVALID once overwritten or merged), log_valid counts the live
+    // blocks of each slot, log_wp the blocks appended to it and log_stamp is the log clock (blocks appended so far)
+    // when it was sealed. zone_states tells free (EMPTY), active (OPEN) and sealed (FULL) log zones apart.
+    uint32_t *log_zone_phys;
+    int32_t *zone_log_slot;
+    uint32_t *log_reverse;
+    uint32_t *log_valid;
+    uint32_t *log_wp;
+    uint64_t *log_stamp;
+    uint64_t log_clock;
+    // resets per physical zone, kept in the checkpoint and the journal
+    uint32_t *zone_resets;
+    // Writes are split into log streams. With hot/cold separation the logical zones whose recent overwrites reach
+    // twice the average go to the hot stream and the rest to the cold one, so the hot log zones are mostly invalid by
+    // the time the gc gets to them. zone_heat counts the overwrites of log blocks per logical zone and is halved
+    // whenever a log zone is sealed. Each stream appends through log_lane_num heads with one active log slot each
+    // (-1 if none is open), head stream * log_lane_num + lane. A logical zone always takes the same lane, so its
+    // appends stay in order in one log zone while the appends of different zones go to different zones in parallel.
+    enum log_stream
+    {
+        LOG_STREAM_HOT = 0,
+        LOG_STREAM_COLD = 1,
+    };
+    int64_t active_log_zone[LOG_HEADS_MAX];
+    uint8_t *log_slot_stream; // stream each log slot was last opened for
+    int log_stream_num = 1;
+    int log_lane_num = 1;
+    int log_head_num = 1;
+    uint32_t *zone_heat;
+    uint64_t heat_total;
+    int log_free_num;
+    int log_slot_num;
+    // Spare zone the gc merges into when every data zone is taken, the old data zone becomes the next spare. It is
+    // taken out of the user capacity rather than the log so background merges never eat into the writers' log space.
+    int64_t gc_reserve_zone = -1;
+    // log slot the gc is reclaiming, a switch merge empties it before the round is over so writers must not open it
+    int64_t gc_victim_slot = -1;
+
+    // Sequential streams: a write of more than one block at the start of a logical zone that has neither a data zone
+    // nor log entries opens a data zone for it, and the writes that go on where the last one ended are written
+    // straight into that zone. They are never merged, data_written publishes them. Anything else written to the zone
+    // goes to the log, once the zone has log entries the stream is over and the gc merges its data zone like any
+    // other. A stream that ends short of the end of its zone journals how far it got, the rest of the zone is a hole.
+    struct seq_stream
+    {
+        int64_t zone_no; // logical zone, -1 if the slot is free
+        uint64_t zslba;
+        uint32_t wp;
+        bool busy; // a write is in flight, the next one waits for it
+        uint64_t last_write;
+    };
+    struct seq_stream seq_streams[SEQ_STREAMS_MAX];
+    int seq_stream_max; // slots in use, 0 disables
+    uint64_t seq_clock;
+    pthread_cond_t seq_done = PTHREAD_COND_INITIALIZER;
+
+    // merge worker pool, see do_merge
+    struct merge_job
+    {
+        std::vector<uint64_t> *zones;
+        int64_t victim;
+        size_t next;
+        size_t done;
+        int status;
+        pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+        pthread_cond_t finished = PTHREAD_COND_INITIALIZER;
+    } merge_job;
+    std::vector<pthread_t> merge_workers;
+    bool merge_workers_stop;
+    uint32_t merges_in_flight;
+    uint32_t merge_zone_max; // merges writing at once, each keeps a zone open and active
+    pthread_cond_t merge_zone_freed = PTHREAD_COND_INITIALIZER;
+    // merges and gc rounds waiting for the appends in flight to be mapped, new appends hold back meanwhile
+    uint32_t commits_waiting;
+    pthread_cond_t appends_drained = PTHREAD_COND_INITIALIZER;
+
+    // Free zones outside the log. zone_pool holds reset zones ready to be claimed ordered by (resets, zone), so claims
+    // take the least worn zone, zone_dirty the zones merges gave up that the resetter thread still has to reset.
+    std::set<std::pair<uint32_t, uint32_t>> zone_pool;
+    std::deque<uint32_t> zone_dirty;
+    uint32_t zones_resetting;
+    pthread_t zone_resetter_id;
+    bool zone_resetter_stop;
+    pthread_cond_t zone_dirty_wakeup = PTHREAD_COND_INITIALIZER;
+
+    // Mapping deltas of the current write group, journaled by meta_commit. Keys are user block numbers (logical zone
+    // times blocks per zone plus offset) for the log and logical zone numbers for the data mapping.
+    enum meta_delta_type
+    {
+        DELTA_LOG_MAP = 1,   // blocks consecutive user blocks from key on live in the log starting at value
+        DELTA_LOG_UNMAP = 2, // blocks consecutive user blocks from key on left the log
+        DELTA_DATA_MAP = 3,  // logical zone key is backed by the data zone starting at value
+        DELTA_CLOCK = 4,     // the deltas behind it were made at log clock value << 32 | key
+        DELTA_ZONE_WEAR = 5, // physical zone key was reset value times
+        DELTA_DATA_WRITTEN = 6, // a stream left the first value blocks of the data zone of logical zone key written
+    };
+
+    struct meta_delta
+    {
+        uint32_t type;
+        uint32_t key;
+        uint32_t value;
+        uint32_t blocks;
+    };
+
+    // Checkpoint layout: this header, then checksummed chunks of varints. The chunks hold the data zone of every
+    // logical zone (0 if none, zone number + 1 otherwise), then the log mapping sorted by user block as extents of
+    // (gap to the end of the last extent, zigzag LBA delta to the end of the last extent, length - 1), then the reset
+    // count of every physical zone, then (logical zone, blocks written) of every data zone a stream left partly written.
+    struct meta_checkpoint
+    {
+        uint32_t logical_zones;
+        uint32_t blocks_per_zone;
+        uint64_t log_entries;
+        uint64_t clock; // log clock when it was taken
+        uint32_t flags; // META_CKPT_LOG_SUMMARIES if the log appends of the epoch carry summaries
+        uint32_t extents;
+        uint32_t zones;
+        uint32_t partial_zones;
+    };
+
+    struct meta_chunk
+    {
+        uint32_t bytes;
+        uint32_t crc; // of the bytes behind the chunk header
+    };
+
+    // writes the checkpoint chunks, an item never straddles two chunks
+    struct meta_encoder
+    {
+        uint8_t *base;
+        uint64_t chunk; // offset of the open chunk
+        uint64_t pos;
+        uint64_t key_end; // user block and log LBA behind the last extent
+        uint64_t lba_end;
+        uint32_t extents;
+    };
+
+    // Group commit of the journal. meta_batch_mutex guards the batch and the counters, meta_write_mutex keeps the
+    // records and checkpoints in order on the device, both come after gc_mutex and map_mutex. Whoever holds
+    // meta_write_mutex writes out the whole batch, the committers queued behind it mostly find their deltas durable by
+    // then. meta_log_delta callers hold gc_mutex or map_mutex, so a checkpoint holding both covers every delta it
+    // clears from the batch.
+    std::vector<struct meta_delta> meta_batch;
+    pthread_mutex_t meta_batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+    pthread_mutex_t meta_write_mutex = PTHREAD_MUTEX_INITIALIZER;
+    uint64_t meta_logged;  // deltas logged so far
+    uint64_t meta_durable; // deltas journaled or covered by a checkpoint, or lost with an error
+    bool meta_full;        // the journal epoch is full, the next commit writes a checkpoint
+    uint64_t meta_failed_start, meta_failed_end; // deltas of the last batch that was lost
+    int meta_failed_status;
+
+    // Log summaries: with info->log_summaries every log append starts with a block naming the user block of each
+    // block behind it, the appends are not journaled and mount rebuilds the log by scanning the log zones.
+    struct log_summary
+    {
+        uint32_t magic;
+        uint32_t count;
+        uint64_t seq; // log clock of the first block, block i was appended at seq + i
+        uint32_t crc; // of the summary with crc 0 and its entries
+        uint32_t pad;
+    };
+
+    // an append or a merge found while mounting, lba is MAP_INVALID if a merge took the block out of the log
+    struct log_event
+    {
+        uint64_t seq;
+        uint32_t block;
+        uint32_t lba;
+    };
+
+    // replay state of an epoch with log summaries, the journaled merges are ordered against the scanned appends
+    bool recovery_summaries;
+    uint64_t recovery_clock;
+    uint64_t recovery_seq;
+    std::vector<struct log_event> recovery_unmaps;
 
     struct user_zns_device *zns_dev;
     struct zns_device_extra_info *zns_dev_ex;
 
+    // Read cache keyed by user block, NULL if disabled. Merges move blocks without changing what a user block holds,
+    // so only the writes invalidate, once the new blocks are mapped.
+    struct ss_cache *read_cache;
+
+    // Write-back buffer of small writes, disabled if capacity is 0. Writers copy into the active half, overwrites of a
+    // buffered block stay in place. The flusher thread swaps the halves and writes the other one out as a vectored
+    // write, so the writers of a flush share its appends. Reads look at both halves before the mapping, a half is
+    // only emptied after its flush was mapped.
+    struct write_buffer
+    {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;  // flusher, the active half is full or a drain waits
+        pthread_cond_t changed = PTHREAD_COND_INITIALIZER; // the halves were swapped or a flush finished
+        std::map<uint64_t, uint32_t> blocks[2];            // user block to slot in data
+        char *data[2];
+        int active;
+        uint32_t drains; // callers waiting for both halves to be written out
+        uint64_t capacity; // blocks per half
+        uint64_t first_write; // ss_lat_now of the oldest write in the active half
+        uint64_t flush_ns;
+        int status; // of the last failed flush, reported by the next drain
+        pthread_t flusher;
+        bool stop;
+    } wbuf;
+    void *write_buffer_flush_loop(void *args);
+
+    // counters of zns_udevice_get_stats, most are bumped without gc_mutex so they are updated with relaxed atomics
+    struct zns_udevice_stats ftl_stats;
+
+    // Read epochs, see gc_read_enter. Each thread counts its reads on one slot, in the half of the current epoch's
+    // parity, so readers on different cores do not share a cache line.
+    struct alignas(64) read_epoch_slot
+    {
+        uint64_t active[2];
+    };
+    struct read_epoch_slot read_slots[READ_EPOCH_SLOTS];
+    uint64_t read_epoch;
+    uint32_t read_slot_next;
+    thread_local uint32_t read_slot = READ_EPOCH_SLOTS;
+    bool read_sync_busy; // a grace period is running, under gc_mutex
+    pthread_cond_t read_sync_done = PTHREAD_COND_INITIALIZER;
+    std::vector<uint32_t *> leaves_retired; // emptied leaves readers may still walk, freed after the next grace period
+
+    void stats_add(uint64_t *counter, uint64_t value)
+    {
+        __atomic_add_fetch(counter, value, __ATOMIC_RELAXED);
+    }
+
+    // caller holds gc_mutex, the stream writing the data zone of a logical zone, NULL if there is none
+    struct seq_stream *seq_find(uint64_t zone_no)
+    {
+        for (int i = 0; i < seq_stream_max; i++)
+        {
+            if (seq_streams[i].zone_no == (int64_t)zone_no)
+                return &seq_streams[i];
+        }
+        return NULL;
+    }
+
+    // position of a log block in the per-slot arrays
+    uint64_t log_block_index(uint32_t lba)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        return zone_log_slot[lba / bpz] * bpz + lba % bpz;
+    }
+
+    void log_block_invalidate(uint32_t lba)
+    {
+        uint64_t index = log_block_index(lba);
+        log_valid[index / zns_dev_ex->blocks_per_zone]--;
+        log_reverse[index] = MAP_INVALID;
+    }
+
+    void log_block_account(uint64_t zone_no, uint64_t offset, uint32_t lba)
+    {
+        uint64_t index = log_block_index(lba);
+        log_valid[index / zns_dev_ex->blocks_per_zone]++;
+        log_reverse[index] = zone_no * zns_dev_ex->blocks_per_zone + offset;
+    }
+
+    // set a leaf entry without touching the per-slot accounting, returns the entry it replaced
+    uint32_t log_leaf_set(uint64_t zone_no, uint64_t offset, uint32_t lba)
+    {
+        uint32_t *leaf = log_mapping[zone_no];
+        if (!leaf)
+        {
+            // readers walk the table without gc_mutex, publish the leaf only once it is initialised
+            leaf = (uint32_t *)malloc(zns_dev_ex->blocks_per_zone * sizeof(uint32_t));
+            memset(leaf, 0xff, zns_dev_ex->blocks_per_zone * sizeof(uint32_t));
+            __atomic_store_n(&log_mapping[zone_no], leaf, __ATOMIC_RELEASE);
+        }
+        uint32_t old = leaf[offset];
+        if (old == MAP_INVALID)
+            log_mapping_count[zone_no]++;
+        __atomic_store_n(&leaf[offset], lba, __ATOMIC_RELEASE);
+        return old;
+    }
+
+    void log_mapping_set(uint64_t zone_no, uint64_t offset, uint32_t lba)
+    {
+        uint32_t old = log_leaf_set(zone_no, offset, lba);
+        if (old != MAP_INVALID)
+            log_block_invalidate(old);
+        log_block_account(zone_no, offset, lba);
+    }
+
+    // clear a leaf entry without touching the per-slot accounting, the leaf goes with its last entry once the
+    // readers that may still walk it are gone
+    void log_leaf_clear(uint64_t zone_no, uint64_t offset)
+    {
+        uint32_t *leaf = log_mapping[zone_no];
+        if (!leaf || leaf[offset] == MAP_INVALID)
+            return;
+        __atomic_store_n(&leaf[offset], MAP_INVALID, __ATOMIC_RELEASE);
+        if (--log_mapping_count[zone_no] == 0)
+        {
+            __atomic_store_n(&log_mapping[zone_no], (uint32_t *)NULL, __ATOMIC_RELEASE);
+            leaves_retired.push_back(leaf);
+        }
+    }
+
+    // caller holds gc_mutex or map_mutex, extends the last delta if this one continues it
+    void meta_log_delta(uint32_t type, uint32_t key, uint32_t value, uint32_t blocks)
+    {
+        pthread_mutex_lock(&meta_batch_mutex);
+        meta_logged++;
+        if (!meta_batch.empty())
+        {
+            struct meta_delta *last = &meta_batch.back();
+            if ((type == DELTA_LOG_MAP || type == DELTA_LOG_UNMAP) && last->type == type && last->key + last->blocks == key &&
+                (type == DELTA_LOG_UNMAP || last->value + last->blocks == value))
+            {
+                last->blocks += blocks;
+                pthread_mutex_unlock(&meta_batch_mutex);
+                return;
+            }
+        }
+        meta_batch.push_back({type, key, value, blocks});
+        pthread_mutex_unlock(&meta_batch_mutex);
+    }
+
+    // drop the log entries of a zone that a merge copied, blocks rewritten while the merge ran stay in the log
+    void log_merge_commit(uint64_t zone_no, const uint32_t *snapshot)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        for (uint64_t i = 0; log_mapping[zone_no] && i < bpz; i++)
+        {
+            uint32_t lba = log_mapping[zone_no][i];
+            if (snapshot[i] == MAP_INVALID || lba != snapshot[i])
+                continue;
+            log_block_invalidate(lba);
+            log_leaf_clear(zone_no, i);
+            meta_log_delta(DELTA_LOG_UNMAP, zone_no * bpz + i, 0, 1);
+        }
+    }
+
+    int mapping_init(uint64_t zones, uint64_t log_zones, uint64_t nr_zones)
+    {
+        uint64_t log_blocks = log_zones * zns_dev_ex->blocks_per_zone;
+        logical_zone_num = zones;
+        log_mapping = (uint32_t **)calloc(zones, sizeof(uint32_t *));
+        log_mapping_count = (uint32_t *)calloc(zones, sizeof(uint32_t));
+        data_mapping = (uint32_t *)malloc(zones * sizeof(uint32_t));
+        data_written = (uint32_t *)calloc(zones, sizeof(uint32_t));
+        log_zone_phys = (uint32_t *)calloc(log_zones, sizeof(uint32_t));
+        zone_log_slot = (int32_t *)malloc(nr_zones * sizeof(int32_t));
+        log_reverse = (uint32_t *)malloc(log_blocks * sizeof(uint32_t));
+        log_valid = (uint32_t *)calloc(log_zones, sizeof(uint32_t));
+        log_wp = (uint32_t *)calloc(log_zones, sizeof(uint32_t));
+        log_stamp = (uint64_t *)calloc(log_zones, sizeof(uint64_t));
+        zone_resets = (uint32_t *)calloc(nr_zones, sizeof(uint32_t));
+        zone_heat = (uint32_t *)calloc(zones, sizeof(uint32_t));
+        log_slot_stream = (uint8_t *)calloc(log_zones, sizeof(uint8_t));
+        if (!log_mapping || !log_mapping_count || !data_mapping || !data_written || !log_zone_phys || !zone_log_slot ||
+            !log_reverse || !log_valid || !log_wp || !log_stamp || !zone_resets || !zone_heat || !log_slot_stream)
+            return -ENOMEM;
+        memset(data_mapping, 0xff, zones * sizeof(uint32_t));
+        memset(zone_log_slot, 0xff, nr_zones * sizeof(int32_t));
+        memset(log_reverse, 0xff, log_blocks * sizeof(uint32_t));
+        log_clock = 0;
+        // the streams of an earlier mount are gone, init opens the slots again
+        seq_stream_max = 0;
+        heat_total = 0;
+        meta_logged = meta_durable = 0;
+        meta_failed_start = meta_failed_end = 0;
+        meta_full = false;
+        recovery_summaries = false;
+        recovery_unmaps.clear();
+        return 0;
+    }
+
+    void mapping_free()
+    {
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+            free(log_mapping[i]);
+        for (auto iter = leaves_retired.begin(); iter != leaves_retired.end(); iter++)
+            free(*iter);
+        leaves_retired.clear();
+        free(log_mapping);
+        free(log_mapping_count);
+        free(data_mapping);
+        free(data_written);
+        free(log_zone_phys);
+        free(zone_log_slot);
+        free(log_reverse);
+        free(log_valid);
+        free(log_wp);
+        free(log_stamp);
+        free(zone_resets);
+        free(zone_heat);
+        free(log_slot_stream);
+        log_mapping = NULL;
+        log_mapping_count = NULL;
+        data_mapping = NULL;
+        data_written = NULL;
+        log_zone_phys = NULL;
+        zone_log_slot = NULL;
+        log_reverse = NULL;
+        log_valid = NULL;
+        log_wp = NULL;
+        log_stamp = NULL;
+        zone_resets = NULL;
+        zone_heat = NULL;
+        log_slot_stream = NULL;
+    }
+
     int ss_nvme_device_io_with_mdts(uint64_t slba, void *buffer, uint64_t buf_size, bool read)
     {
         int ret;
@@ -68,6 +513,7 @@ extern "C"
                 ret = nvme_write(zns_dev_ex->fd, zns_dev_ex->nsid, wp, lba_num, 0, 0, 0, 0, 0, 0, io_num, (char *)(buffer) + ptr, 0, NULL);
             if (ret != 0)
                 return ret;
+            stats_add(read ? &ftl_stats.device_bytes_read : &ftl_stats.device_bytes_written, io_num);
             ptr += io_num;
             size_left -= io_num;
             wp += lba_num + 1;
@@ -75,519 +521,2928 @@ extern "C"
         return ret;
     }
 
-    int metadata_write(struct zns_device_extra_info *info, void *buffer, uint32_t size)
+    // LEB128 varint, 7 bits per byte with the high bit set on all but the last
+    uint8_t *meta_put_varint(uint8_t *out, uint64_t value)
+    {
+        for (; value >= 0x80; value >>= 7)
+            *out++ = (uint8_t)value | 0x80;
+        *out++ = (uint8_t)value;
+        return out;
+    }
+
+    // returns NULL if the varint runs past end
+    const uint8_t *meta_get_varint(const uint8_t *in, const uint8_t *end, uint64_t *value)
     {
-        __u64 res_lba;
-        uint32_t blocks = size / zns_dev->lba_size_bytes;
-        uint64_t last_zone = zns_dev->tparams.zns_num_zones - 1;
-        if (size % zns_dev->lba_size_bytes)
+        *value = 0;
+        for (int shift = 0; in < end && shift < 64; shift += 7)
         {
-            printf("INVALID: write size not aligned to block size\n");
-            return -1;
+            *value |= (uint64_t)(*in & 0x7f) << shift;
+            if (!(*in++ & 0x80))
+                return in;
         }
-        int ret;
-        // if (zns_dev_ex->zone_states[last_zone] != EMPTY)
-        // {
-            ret = nvme_zns_mgmt_send(zns_dev_ex->fd, zns_dev_ex->nsid, last_zone * info->blocks_per_zone, false, NVME_ZNS_ZSA_RESET, 0, NULL);
-            if (ret)
+        return NULL;
+    }
+
+    void meta_chunk_seal(struct meta_encoder *enc)
+    {
+        struct meta_chunk chunk;
+        chunk.bytes = enc->pos - enc->chunk - sizeof(chunk);
+        chunk.crc = ss_meta_crc(0, enc->base + enc->chunk + sizeof(chunk), chunk.bytes);
+        memcpy(enc->base + enc->chunk, &chunk, sizeof(chunk));
+    }
+
+    void meta_chunk_open(struct meta_encoder *enc)
+    {
+        enc->chunk = enc->pos;
+        enc->pos += sizeof(struct meta_chunk);
+    }
+
+    // appends the varints of one item, sealing the open chunk first if they might not fit
+    void meta_encode(struct meta_encoder *enc, const uint64_t *values, int count)
+    {
+        if (enc->pos - enc->chunk - sizeof(struct meta_chunk) + count * META_VARINT_MAX > META_CHUNK_BYTES)
+        {
+            meta_chunk_seal(enc);
+            meta_chunk_open(enc);
+        }
+        uint8_t *out = enc->base + enc->pos;
+        for (int i = 0; i < count; i++)
+            out = meta_put_varint(out, values[i]);
+        enc->pos = out - enc->base;
+    }
+
+    void meta_encode_extent(struct meta_encoder *enc, uint64_t key, uint64_t lba, uint64_t len)
+    {
+        int64_t delta = (int64_t)lba - (int64_t)enc->lba_end;
+        uint64_t extent[3] = {key - enc->key_end, (uint64_t)delta << 1 ^ (uint64_t)(delta >> 63), len - 1};
+        meta_encode(enc, extent, 3);
+        enc->key_end = key + len;
+        enc->lba_end = lba + len;
+        enc->extents++;
+    }
+
+    // worst case size of a checkpoint, with every mapped block an extent of its own
+    uint64_t meta_checkpoint_max(uint64_t logical_zones, uint64_t zones, uint64_t entries)
+    {
+        uint64_t bytes = (3 * logical_zones + zones + 3 * entries) * META_VARINT_MAX;
+        uint64_t chunks = bytes / (META_CHUNK_BYTES - 3 * META_VARINT_MAX) + 1;
+        return sizeof(struct meta_checkpoint) + bytes + chunks * sizeof(struct meta_chunk);
+    }
+
+    // caller holds meta_batch_mutex, the deltas up to end are durable or, with status, lost
+    void meta_settle(uint64_t end, int status)
+    {
+        if (status)
+        {
+            // a failure right behind the last one extends it, its committers may still be queued
+            if (meta_failed_end != meta_durable)
+                meta_failed_start = meta_durable;
+            meta_failed_end = end;
+            meta_failed_status = status;
+        }
+        meta_durable = std::max(meta_durable, end);
+    }
+
+    // caller holds meta_batch_mutex, how the commit of the deltas up to end went once they are settled
+    int meta_outcome(uint64_t end)
+    {
+        return end > meta_failed_start && end <= meta_failed_end ? meta_failed_status : 0;
+    }
+
+    // caller holds gc_mutex, writes the whole mapping as a checkpoint, which also covers the pending deltas
+    int meta_checkpoint()
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone, entries = 0;
+        pthread_mutex_lock(&map_mutex);
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+            entries += log_mapping_count[i];
+
+        uint64_t nr_zones = zns_dev->tparams.zns_num_zones;
+        struct meta_checkpoint *ckpt = (struct meta_checkpoint *)malloc(meta_checkpoint_max(logical_zone_num, nr_zones, entries));
+        if (!ckpt)
+        {
+            pthread_mutex_unlock(&map_mutex);
+            return -ENOMEM;
+        }
+        ckpt->logical_zones = logical_zone_num;
+        ckpt->blocks_per_zone = bpz;
+        ckpt->log_entries = entries;
+        ckpt->clock = log_clock;
+        ckpt->flags = zns_dev_ex->log_summaries ? META_CKPT_LOG_SUMMARIES : 0;
+        ckpt->extents = 0;
+        ckpt->zones = nr_zones;
+        ckpt->partial_zones = 0;
+
+        struct meta_encoder enc = {(uint8_t *)ckpt, 0, sizeof(*ckpt), 0, 0, 0};
+        meta_chunk_open(&enc);
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            uint64_t zone = data_mapping[i] == MAP_INVALID ? 0 : data_mapping[i] / bpz + 1;
+            meta_encode(&enc, &zone, 1);
+        }
+        // runs of consecutive blocks appended in order collapse into one extent
+        uint64_t start = 0, first = 0, len = 0;
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            for (uint64_t j = 0; log_mapping[i] && j < bpz; j++)
             {
-                printf("ERROR: failed to reset at metadata block 0x%lx, ret: %ld \n", (last_zone)*info->blocks_per_zone, ret);
-                return ret;
+                uint64_t key = i * bpz + j, lba = log_mapping[i][j];
+                if (lba == MAP_INVALID)
+                    continue;
+                if (len && key == start + len && lba == first + len)
+                {
+                    len++;
+                    continue;
+                }
+                if (len)
+                    meta_encode_extent(&enc, start, first, len);
+                start = key;
+                first = lba;
+                len = 1;
+            }
+        }
+        if (len)
+            meta_encode_extent(&enc, start, first, len);
+        ckpt->extents = enc.extents;
+        for (uint64_t i = 0; i < nr_zones; i++)
+        {
+            uint64_t resets = zone_resets[i];
+            meta_encode(&enc, &resets, 1);
+        }
+        // the data zone of a live stream counts up to its write pointer
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            uint64_t partial[2] = {i, data_written[i]};
+            if (data_mapping[i] == MAP_INVALID || data_written[i] == bpz || seq_find(i))
+                continue;
+            meta_encode(&enc, partial, 2);
+            ckpt->partial_zones++;
+        }
+        meta_chunk_seal(&enc);
+
+        pthread_mutex_lock(&meta_write_mutex);
+        pthread_mutex_lock(&meta_batch_mutex);
+        uint64_t end = meta_logged;
+        meta_batch.clear();
+        pthread_mutex_unlock(&meta_batch_mutex);
+        pthread_mutex_unlock(&map_mutex);
+        int ret = ss_meta_log_checkpoint(zns_dev_ex->meta_log, ckpt, enc.pos);
+        free(ckpt);
+        if (ret)
+            printf("ERROR: failed to write the mapping checkpoint, ret: %d\n", ret);
+        pthread_mutex_lock(&meta_batch_mutex);
+        meta_settle(end, ret);
+        meta_full = false;
+        pthread_mutex_unlock(&meta_batch_mutex);
+        pthread_mutex_unlock(&meta_write_mutex);
+        return ret;
+    }
+
+    // Makes the deltas logged so far durable. They go out as journal records, once the epoch is full a checkpoint
+    // takes their place and starts the next one. The checkpoint needs gc_mutex, which comes before the metadata locks,
+    // so a committer without it only takes it then.
+    int meta_sync(bool gc_locked)
+    {
+        pthread_mutex_lock(&meta_batch_mutex);
+        uint64_t target = meta_logged;
+        pthread_mutex_unlock(&meta_batch_mutex);
+
+        pthread_mutex_lock(&meta_write_mutex);
+        pthread_mutex_lock(&meta_batch_mutex);
+        if (meta_durable >= target)
+        {
+            int ret = meta_outcome(target);
+            pthread_mutex_unlock(&meta_batch_mutex);
+            pthread_mutex_unlock(&meta_write_mutex);
+            return ret;
+        }
+        std::vector<struct meta_delta> batch;
+        batch.swap(meta_batch);
+        uint64_t end = meta_logged;
+        bool full = meta_full;
+        pthread_mutex_unlock(&meta_batch_mutex);
+
+        uint64_t per_record = ss_meta_log_max_payload(zns_dev_ex->meta_log) / sizeof(struct meta_delta);
+        uint64_t start = ss_lat_now();
+        int ret = full ? -ENOSPC : 0;
+        for (uint64_t i = 0; !ret && i < batch.size(); i += per_record)
+        {
+            uint64_t n = std::min(per_record, (uint64_t)batch.size() - i);
+            ret = ss_meta_log_journal(zns_dev_ex->meta_log, &batch[i], n * sizeof(struct meta_delta));
+            // the metadata log moves on to a fresh zone, the next commit writes a checkpoint
+            if (ret && ret != -ENOSPC)
+                printf("ERROR: failed to journal the mapping, ret: %d\n", ret);
+        }
+        ss_lat_record(ZNS_LAT_META, start);
+        pthread_mutex_lock(&meta_batch_mutex);
+        if (ret == -ENOSPC)
+            meta_full = true;
+        else
+            meta_settle(end, ret);
+        pthread_mutex_unlock(&meta_batch_mutex);
+        pthread_mutex_unlock(&meta_write_mutex);
+        if (ret != -ENOSPC)
+            return ret;
+
+        // the batch is still in the tables, the checkpoint covers it unless one was written meanwhile
+        if (!gc_locked)
+            pthread_mutex_lock(&zns_dev_ex->gc_mutex);
+        pthread_mutex_lock(&meta_batch_mutex);
+        bool covered = meta_durable >= end;
+        ret = covered ? meta_outcome(end) : 0;
+        pthread_mutex_unlock(&meta_batch_mutex);
+        if (!covered)
+            ret = meta_checkpoint();
+        if (!gc_locked)
+            pthread_mutex_unlock(&zns_dev_ex->gc_mutex);
+        return ret;
+    }
+
+    // caller holds gc_mutex
+    int meta_commit()
+    {
+        return meta_sync(true);
+    }
+
+    void meta_restore_log(uint64_t block, uint32_t lba)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        if (block / bpz < logical_zone_num)
+            log_leaf_set(block / bpz, block % bpz, lba);
+    }
+
+    void meta_restore_unmap(uint64_t block)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        if (block / bpz < logical_zone_num)
+            log_leaf_clear(block / bpz, block % bpz);
+    }
+
+    void meta_restore_data(uint64_t zone_no, uint32_t lba)
+    {
+        if (zone_no < logical_zone_num)
+        {
+            data_mapping[zone_no] = lba;
+            data_written[zone_no] = lba == MAP_INVALID ? 0 : zns_dev_ex->blocks_per_zone;
+        }
+        else if (lba != MAP_INVALID)
+            printf("INFO: dropping data zone of logical zone %lu, it is beyond the device capacity\n", zone_no);
+    }
+
+    // restores the tables from the chunks of a checkpoint ending at end
+    int meta_decode(const struct meta_checkpoint *ckpt, const uint8_t *end)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone, items = 0, mapped = 0, key_end = 0, lba_end = 0;
+        const uint8_t *in = (const uint8_t *)(ckpt + 1);
+        while (in < end)
+        {
+            struct meta_chunk chunk;
+            if ((uint64_t)(end - in) < sizeof(chunk))
+                return -EINVAL;
+            memcpy(&chunk, in, sizeof(chunk));
+            in += sizeof(chunk);
+            if (chunk.bytes > (uint64_t)(end - in) || ss_meta_crc(0, in, chunk.bytes) != chunk.crc)
+                return -EINVAL;
+            for (const uint8_t *chunk_end = in + chunk.bytes; in < chunk_end; items++)
+            {
+                uint64_t value[3], extents_end = (uint64_t)ckpt->logical_zones + ckpt->extents, zones_end = extents_end + ckpt->zones;
+                int count = items >= zones_end ? 2 : items < ckpt->logical_zones || items >= extents_end ? 1 : 3;
+                for (int i = 0; i < count; i++)
+                {
+                    if (!(in = meta_get_varint(in, chunk_end, &value[i])))
+                        return -EINVAL;
+                }
+                if (items >= zones_end)
+                {
+                    if (value[0] < logical_zone_num)
+                        data_written[value[0]] = std::min(value[1], bpz);
+                    continue;
+                }
+                if (items >= extents_end)
+                {
+                    if (items - extents_end < zns_dev->tparams.zns_num_zones)
+                        zone_resets[items - extents_end] = value[0];
+                    continue;
+                }
+                if (count == 1)
+                {
+                    meta_restore_data(items, value[0] ? (value[0] - 1) * bpz : MAP_INVALID);
+                    continue;
+                }
+                uint64_t key = key_end + value[0], lba = lba_end + (int64_t)(value[1] >> 1 ^ -(value[1] & 1)), len = value[2] + 1;
+                for (uint64_t i = 0; i < len; i++)
+                    meta_restore_log(key + i, lba + i);
+                key_end = key + len;
+                lba_end = lba + len;
+                mapped += len;
+            }
+        }
+        return items == (uint64_t)ckpt->logical_zones + ckpt->extents + ckpt->zones + ckpt->partial_zones && mapped == ckpt->log_entries ? 0 : -EINVAL;
+    }
+
+    // replays the metadata region into the tables, the per-slot accounting is rebuilt by log_zones_init
+    int meta_apply(void *, enum ss_meta_record type, const void *payload, uint64_t size)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        if (type == SS_META_CHECKPOINT)
+        {
+            const struct meta_checkpoint *ckpt = (const struct meta_checkpoint *)payload;
+            if (size < sizeof(*ckpt) || ckpt->blocks_per_zone != bpz)
+            {
+                printf("ERROR: the mapping checkpoint does not match the device\n");
+                return -EINVAL;
+            }
+            recovery_summaries = ckpt->flags & META_CKPT_LOG_SUMMARIES;
+            recovery_clock = recovery_seq = log_clock = ckpt->clock;
+            if (meta_decode(ckpt, (const uint8_t *)payload + size))
+            {
+                printf("ERROR: the mapping checkpoint is corrupt\n");
+                return -EINVAL;
+            }
+            return 0;
+        }
+
+        const struct meta_delta *delta = (const struct meta_delta *)payload;
+        for (uint64_t i = 0; i < size / sizeof(struct meta_delta); i++, delta++)
+        {
+            for (uint64_t j = 0; delta->type == DELTA_LOG_MAP && j < delta->blocks; j++)
+                meta_restore_log((uint64_t)delta->key + j, delta->value + j);
+            for (uint64_t j = 0; delta->type == DELTA_LOG_UNMAP && j < delta->blocks; j++)
+            {
+                // the appends of a summary epoch are only known once the log zones are scanned
+                if (recovery_summaries)
+                    recovery_unmaps.push_back({recovery_seq, delta->key + (uint32_t)j, MAP_INVALID});
+                else
+                    meta_restore_unmap((uint64_t)delta->key + j);
+            }
+            if (delta->type == DELTA_DATA_MAP)
+                meta_restore_data(delta->key, delta->value);
+            if (delta->type == DELTA_ZONE_WEAR && delta->key < zns_dev->tparams.zns_num_zones)
+                zone_resets[delta->key] = delta->value;
+            if (delta->type == DELTA_DATA_WRITTEN && delta->key < logical_zone_num)
+                data_written[delta->key] = std::min((uint64_t)delta->value, bpz);
+            if (delta->type == DELTA_CLOCK)
+            {
+                recovery_seq = (uint64_t)delta->value << 32 | delta->key;
+                log_clock = std::max(log_clock, recovery_seq);
             }
-        // }
+        }
+        return 0;
+    }
+
+    struct log_scan_job
+    {
+        const std::vector<std::pair<uint32_t, uint32_t>> *zones; // (zone, blocks written)
+        uint32_t *next;
+        std::vector<struct log_event> events;
+    };
+
+    // walks the summary blocks of a zone up to the first one that does not check out, a torn append ends the zone
+    void log_scan_zone(uint32_t zone, uint32_t written, char *block, std::vector<struct log_event> *events)
+    {
+        uint64_t lbs = zns_dev->lba_size_bytes, zslba = (uint64_t)zone * zns_dev_ex->blocks_per_zone;
+        uint64_t summary_max = (lbs - sizeof(struct log_summary)) / sizeof(uint32_t);
+        struct log_summary *sum = (struct log_summary *)block;
+        const uint32_t *entries = (const uint32_t *)(sum + 1);
+        for (uint64_t off = 0; off < written; off += 1 + sum->count)
+        {
+            if (nvme_read(zns_dev_ex->fd, zns_dev_ex->nsid, zslba + off, 0, 0, 0, 0, 0, 0, lbs, block, 0, NULL))
+                return;
+            stats_add(&ftl_stats.device_bytes_read, lbs);
+            if (sum->magic != LOG_SUMMARY_MAGIC || !sum->count || sum->count > summary_max || off + 1 + sum->count > written)
+                return;
+            uint32_t crc = sum->crc;
+            sum->crc = 0;
+            if (ss_meta_crc(0, block, sizeof(*sum) + sum->count * sizeof(uint32_t)) != crc)
+                return;
+            for (uint32_t i = 0; i < sum->count; i++)
+                events->push_back({sum->seq + i, entries[i], (uint32_t)(zslba + off + 1 + i)});
+        }
+    }
+
+    void *log_scan_worker(void *args)
+    {
+        struct log_scan_job *job = (struct log_scan_job *)args;
+        char *block = (char *)malloc(zns_dev->lba_size_bytes);
+        uint32_t i;
+        while ((i = __atomic_fetch_add(job->next, 1, __ATOMIC_RELAXED)) < job->zones->size())
+            log_scan_zone((*job->zones)[i].first, (*job->zones)[i].second, block, &job->events);
+        free(block);
+        return (void *)0;
+    }
+
+    // Rebuilds the log of an epoch with log summaries: every written zone that is not a data zone is scanned by
+    // `workers` threads, then the appends newer than the checkpoint and the journaled merges are replayed in log clock
+    // order. zone_wp holds the blocks written per zone.
+    int log_recover_scan(const std::vector<uint32_t> &zone_wp, int workers)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        std::vector<bool> data_zone(zone_wp.size(), false);
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            if (data_mapping[i] != MAP_INVALID)
+                data_zone[data_mapping[i] / bpz] = true;
+        }
+        std::vector<std::pair<uint32_t, uint32_t>> zones;
+        for (uint32_t i = 0; i < zns_dev_ex->meta_zone_start; i++)
+        {
+            if (zone_wp[i] && !data_zone[i])
+                zones.push_back(std::make_pair(i, zone_wp[i]));
+        }
 
-        ret = nvme_zns_append(info->fd, info->nsid, last_zone * info->blocks_per_zone, blocks - 1, 0, 0, 0, 0, size, buffer, 0, NULL, &res_lba);
+        uint32_t next = 0;
+        std::vector<struct log_scan_job> jobs(workers);
+        std::vector<pthread_t> threads;
+        int ret = 0;
+        for (int i = 0; i < workers; i++)
+        {
+            jobs[i].zones = &zones;
+            jobs[i].next = &next;
+            pthread_t thread;
+            ret = pthread_create(&thread, NULL, &log_scan_worker, &jobs[i]);
+            if (ret)
+                break;
+            threads.push_back(thread);
+        }
+        for (auto iter = threads.begin(); iter != threads.end(); iter++)
+            pthread_join(*iter, NULL);
         if (ret)
         {
-            printf("ERROR: failed to write at metadata block 0x%lx, ret: %ld, size:%d \n", (last_zone)*info->blocks_per_zone, ret, size);
+            printf("ERROR: failed to create log scan threads %d \n", ret);
             return ret;
         }
+
+        // merges go first, so a merge and an append at the same log clock replay as merge then append
+        std::vector<struct log_event> events;
+        events.swap(recovery_unmaps);
+        for (auto iter = jobs.begin(); iter != jobs.end(); iter++)
+        {
+            for (auto event = iter->events.begin(); event != iter->events.end(); event++)
+            {
+                if (event->seq >= recovery_clock)
+                    events.push_back(*event);
+            }
+        }
+        std::stable_sort(events.begin(), events.end(),
+                         [](const struct log_event &a, const struct log_event &b) { return a.seq < b.seq; });
+        for (auto iter = events.begin(); iter != events.end(); iter++)
+        {
+            if (iter->lba == MAP_INVALID)
+                meta_restore_unmap(iter->block);
+            else
+            {
+                meta_restore_log(iter->block, iter->lba);
+                log_clock = std::max(log_clock, iter->seq + 1);
+            }
+        }
+        printf("INFO: rebuilt the log from %lu appended blocks in %lu zones\n", events.size(), zones.size());
         return 0;
     }
 
-    int metadata_read(struct zns_device_extra_info *info, void *buffer, uint32_t size)
+    uint64_t log_active_room(int head)
     {
-        uint32_t blocks = size / zns_dev->lba_size_bytes;
-        if (size % zns_dev->lba_size_bytes)
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        uint64_t room = active_log_zone[head] == -1 ? 0 : bpz - log_wp[active_log_zone[head]];
+        // a zone with no room behind its next summary block is as good as full
+        return zns_dev_ex->log_summaries && room == 1 ? 0 : room;
+    }
+
+    // number of log zones that are still free once `blocks` more blocks are appended to `head`, active zones count
+    // as free until they fill up. A writer (head != -1) only counts its own active zone, the gc (-1) counts all.
+    int get_free_lz_num(uint64_t blocks, int head)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        int64_t free_num = log_free_num;
+        for (int i = 0; i < log_head_num; i++)
         {
-            printf("INVALID: read size not aligned to block size\n");
-            return -1;
+            if ((head == -1 || head == i) && log_active_room(i))
+                free_num++;
+        }
+        uint64_t room = head == -1 ? 0 : log_active_room(head);
+        if (room && blocks >= room)
+        {
+            free_num--;
+            blocks -= room;
         }
-        int ret = nvme_read(info->fd, info->nsid, (zns_dev->tparams.zns_num_zones - 1) * info->blocks_per_zone, blocks - 1, 0, 0, 0, 0, 0, size, buffer, 0, NULL);
+        return free_num - blocks / bpz;
+    }
+
+    // resets a zone the caller owns, gc_mutex need not be held
+    int zone_reset_cmd(uint64_t zone)
+    {
+        uint64_t start = ss_lat_now();
+        int ret = nvme_zns_mgmt_send(zns_dev_ex->fd, zns_dev_ex->nsid, zone * zns_dev_ex->blocks_per_zone, false, NVME_ZNS_ZSA_RESET, 0, NULL);
         if (ret)
         {
-            printf("INFO: failed to read metadata block at 0x%lx, ret: %ld\n", (zns_dev->tparams.zns_num_zones - 1) * info->blocks_per_zone, ret);
-            return ret;
+            printf("ERROR: failed to reset zone %lu, ret: %d\n", zone, ret);
+            return ret;
+        }
+        zns_dev_ex->zone_states[zone] = EMPTY;
+        ss_zone_reset_done(zns_dev_ex->zone_mgr, zone);
+        zone_resets[zone]++;
+        stats_add(&ftl_stats.zone_resets, 1);
+        ss_lat_record(ZNS_LAT_RESET, start);
+        return 0;
+    }
+
+    // caller holds gc_mutex, the new reset count goes out with the next commit
+    int zone_reset(uint64_t zone)
+    {
+        int ret = zone_reset_cmd(zone);
+        if (!ret)
+            meta_log_delta(DELTA_ZONE_WEAR, zone, zone_resets[zone], 1);
+        return ret;
+    }
+
+    // Readers take no lock. A read enters the current epoch on its thread's slot for the whole request (until
+    // completion for async reads) and gets a ticket to leave it with. The gc never changes in place what a reader may
+    // still be looking at: it publishes the new mapping first, then gc_read_synchronize starts a new epoch and waits
+    // for the readers of the old one before the zones and leaves the old mapping pointed to are reset or freed.
+    uint32_t gc_read_enter()
+    {
+        if (read_slot == READ_EPOCH_SLOTS)
+            read_slot = __atomic_fetch_add(&read_slot_next, 1, __ATOMIC_RELAXED) % READ_EPOCH_SLOTS;
+        while (1)
+        {
+            uint64_t epoch = __atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST);
+            uint64_t *active = &read_slots[read_slot].active[epoch & 1];
+            __atomic_add_fetch(active, 1, __ATOMIC_SEQ_CST);
+            // a grace period that started in between may have summed this half already, enter the new epoch instead
+            if (__atomic_load_n(&read_epoch, __ATOMIC_SEQ_CST) == epoch)
+                return read_slot * 2 + (epoch & 1);
+            __atomic_sub_fetch(active, 1, __ATOMIC_SEQ_CST);
+        }
+    }
+
+    void gc_read_exit(uint32_t ticket)
+    {
+        __atomic_sub_fetch(&read_slots[ticket / 2].active[ticket % 2], 1, __ATOMIC_RELEASE);
+    }
+
+    // Caller holds gc_mutex and has published the mapping that no longer points to what it is about to reset or free.
+    // Waits until every read that started before is done. The mutex is dropped meanwhile since async read
+    // completions may be queued behind append completions that need it.
+    void gc_read_synchronize(struct zns_device_extra_info *info)
+    {
+        while (read_sync_busy)
+            pthread_cond_wait(&read_sync_done, &info->gc_mutex);
+        read_sync_busy = true;
+        std::vector<uint32_t *> retired;
+        retired.swap(leaves_retired);
+        uint64_t start = ss_lat_now(), epoch = __atomic_fetch_add(&read_epoch, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&info->gc_mutex);
+        for (uint32_t i = 0; i < READ_EPOCH_SLOTS; i++)
+        {
+            while (__atomic_load_n(&read_slots[i].active[epoch & 1], __ATOMIC_SEQ_CST))
+                sched_yield();
+        }
+        for (auto iter = retired.begin(); iter != retired.end(); iter++)
+            free(*iter);
+        pthread_mutex_lock(&info->gc_mutex);
+        read_sync_busy = false;
+        pthread_cond_broadcast(&read_sync_done);
+
+        uint64_t pause = ss_lat_now() - start;
+        stats_add(&ftl_stats.gc_pause_ns, pause);
+        if (pause > ftl_stats.gc_pause_max_ns)
+            __atomic_store_n(&ftl_stats.gc_pause_max_ns, pause, __ATOMIC_RELAXED);
+    }
+
+    int log_sealed_num()
+    {
+        int active = 0;
+        for (int i = 0; i < log_head_num; i++)
+            active += active_log_zone[i] != -1;
+        return log_slot_num - log_free_num - active;
+    }
+
+    void log_slot_assign(uint64_t slot, uint64_t zone)
+    {
+        log_zone_phys[slot] = zone;
+        zone_log_slot[zone] = slot;
+    }
+
+    // Pick the log zones at mount, they are not fixed since switch merges move zones between log and data. Zones
+    // referenced by log entries come first and are sealed, written zones nothing points to are garbage and reset,
+    // the rest of the slots are filled with empty zones. Also rebuilds the per-slot accounting from the leaves. zone_wp
+    // holds the blocks written per zone, a sealed zone keeps its write pointer so a partial merge can still take it.
+    int log_zones_init(const std::vector<uint32_t> &zone_wp)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone, nr_zones = zns_dev->tparams.zns_num_zones;
+        std::vector<bool> in_use(nr_zones, false);
+        for (uint64_t i = zns_dev_ex->meta_zone_start; i < nr_zones; i++)
+            in_use[i] = true;
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            if (data_mapping[i] != MAP_INVALID)
+                in_use[data_mapping[i] / bpz] = true;
+        }
+
+        uint64_t slot = 0;
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            for (uint64_t j = 0; log_mapping[i] && j < bpz; j++)
+            {
+                uint64_t zone = log_mapping[i][j] / bpz;
+                if (log_mapping[i][j] == MAP_INVALID || in_use[zone])
+                    continue;
+                in_use[zone] = true;
+                zns_dev_ex->zone_states[zone] = FULL;
+                log_wp[slot] = zone_wp[zone];
+                log_slot_assign(slot++, zone);
+            }
+        }
+
+        for (uint64_t i = 0; i < nr_zones; i++)
+        {
+            if (in_use[i] || zns_dev_ex->zone_states[i] == EMPTY)
+                continue;
+            int ret = zone_reset(i);
+            if (ret)
+                return ret;
+        }
+
+        log_free_num = 0;
+        for (int i = 0; i < LOG_HEADS_MAX; i++)
+            active_log_zone[i] = -1;
+        memset(log_slot_stream, LOG_STREAM_COLD, zns_dev_ex->log_zone_num_config);
+        gc_reserve_zone = -1;
+        gc_victim_slot = -1;
+        zone_pool.clear();
+        zone_dirty.clear();
+        // the pool is ordered by wear, the least worn zones become data zones first
+        for (uint64_t i = 0; i < nr_zones; i++)
+        {
+            if (in_use[i])
+                continue;
+            if (slot < (uint64_t)zns_dev_ex->log_zone_num_config)
+            {
+                log_wp[slot] = 0;
+                log_slot_assign(slot++, i);
+                log_free_num++;
+            }
+            else if (gc_reserve_zone == -1)
+                gc_reserve_zone = i;
+            else
+                zone_pool.insert(std::make_pair(zone_resets[i], i));
+        }
+        log_slot_num = slot;
+
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            for (uint64_t j = 0; log_mapping[i] && j < bpz; j++)
+            {
+                if (log_mapping[i][j] != MAP_INVALID)
+                    log_block_account(i, j, log_mapping[i][j]);
+            }
+        }
+        return 0;
+    }
+
+    void log_seal_zone(int head)
+    {
+        // a zone given up before it is full is left open on the device, until a partial merge takes it back it may
+        // be finished to free its active resource
+        if (log_wp[active_log_zone[head]] < zns_dev_ex->blocks_per_zone)
+            ss_zone_idle(zns_dev_ex->zone_mgr, log_zone_phys[active_log_zone[head]]);
+        zns_dev_ex->zone_states[log_zone_phys[active_log_zone[head]]] = FULL;
+        log_stamp[active_log_zone[head]] = log_clock;
+        active_log_zone[head] = -1;
+        // the heat of a logical zone fades with every sealed log zone
+        pthread_mutex_lock(&map_mutex);
+        heat_total = 0;
+        for (uint64_t i = 0; log_stream_num > 1 && i < logical_zone_num; i++)
+        {
+            zone_heat[i] /= 2;
+            heat_total += zone_heat[i];
+        }
+        pthread_mutex_unlock(&map_mutex);
+    }
+
+    int log_open_zone(int head)
+    {
+        for (int i = 0; i < log_slot_num; i++)
+        {
+            if (i != gc_victim_slot && zns_dev_ex->zone_states[log_zone_phys[i]] == EMPTY)
+            {
+                zns_dev_ex->zone_states[log_zone_phys[i]] = OPEN;
+                active_log_zone[head] = i;
+                log_slot_stream[i] = head / log_lane_num;
+                log_free_num--;
+                log_wp[i] = 0;
+                zns_dev_ex->log_zone_end = log_zone_phys[i] * zns_dev_ex->blocks_per_zone;
+                return 0;
+            }
+        }
+        return -ENOSPC;
+    }
+
+    // caller holds gc_mutex, takes a reset zone off the pool and returns its start LBA, -1 if none is ready
+    int64_t zone_pool_take()
+    {
+        if (zone_pool.empty())
+            return -1;
+        uint64_t zone = zone_pool.begin()->second;
+        zone_pool.erase(zone_pool.begin());
+        return zone * zns_dev_ex->blocks_per_zone;
+    }
+
+    // caller holds gc_mutex and has waited out the readers that could still be on the zone, the resetter takes it from
+    // here and puts it back in the pool
+    void zone_release(uint64_t zone)
+    {
+        zone_dirty.push_back(zone);
+        pthread_cond_signal(&zone_dirty_wakeup);
+    }
+
+    // Resets released zones off the gc path. A zone left dirty at unmount is garbage the next mount resets.
+    void *zone_resetter_loop(void *args)
+    {
+        struct zns_device_extra_info *info = (struct zns_device_extra_info *)args;
+        pthread_mutex_lock(&info->gc_mutex);
+        while (1)
+        {
+            while (!zone_resetter_stop && zone_dirty.empty())
+                pthread_cond_wait(&zone_dirty_wakeup, &info->gc_mutex);
+            if (zone_resetter_stop)
+                break;
+
+            uint64_t zone = zone_dirty.front();
+            zone_dirty.pop_front();
+            zones_resetting++;
+            pthread_mutex_unlock(&info->gc_mutex);
+            int ret = zone_reset_cmd(zone);
+            pthread_mutex_lock(&info->gc_mutex);
+            zones_resetting--;
+            // a zone that fails to reset stays out of the pool until the next mount
+            if (!ret)
+            {
+                meta_log_delta(DELTA_ZONE_WEAR, zone, zone_resets[zone], 1);
+                zone_pool.insert(std::make_pair(zone_resets[zone], zone));
+            }
+            // the reset counts go out once the released zones are through, a crash loses one batch at most
+            if (zone_dirty.empty())
+                meta_commit();
+            pthread_cond_broadcast(&merge_zone_freed);
+        }
+        pthread_mutex_unlock(&info->gc_mutex);
+        return (void *)0;
+    }
+
+    // Pool of MDTS sized merge buffers, carved out of one hugepage mapping when the system has hugepages reserved and
+    // out of page aligned memory otherwise. Buffers are handed out whole, a caller that finds the pool empty waits.
+    struct merge_buffer_pool
+    {
+        char *memory;
+        uint64_t length;
+        bool hugepages;
+        std::vector<char *> free_list;
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t available = PTHREAD_COND_INITIALIZER;
+    } merge_pool;
+
+    int merge_pool_init(uint32_t count, uint64_t size)
+    {
+        merge_pool.length = roundup(count * size, HUGEPAGE_SIZE);
+        merge_pool.memory = (char *)mmap(NULL, merge_pool.length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        merge_pool.hugepages = merge_pool.memory != MAP_FAILED;
+        if (!merge_pool.hugepages && posix_memalign((void **)&merge_pool.memory, 4096, count * size))
+            return -ENOMEM;
+        merge_pool.free_list.clear();
+        for (uint32_t i = 0; i < count; i++)
+            merge_pool.free_list.push_back(merge_pool.memory + i * size);
+        return 0;
+    }
+
+    void merge_pool_free()
+    {
+        if (merge_pool.hugepages)
+            munmap(merge_pool.memory, merge_pool.length);
+        else
+            free(merge_pool.memory);
+        merge_pool.memory = NULL;
+        merge_pool.free_list.clear();
+    }
+
+    char *merge_buffer_get()
+    {
+        pthread_mutex_lock(&merge_pool.mutex);
+        while (merge_pool.free_list.empty())
+            pthread_cond_wait(&merge_pool.available, &merge_pool.mutex);
+        char *buffer = merge_pool.free_list.back();
+        merge_pool.free_list.pop_back();
+        pthread_mutex_unlock(&merge_pool.mutex);
+        return buffer;
+    }
+
+    void merge_buffer_put(char *buffer)
+    {
+        pthread_mutex_lock(&merge_pool.mutex);
+        merge_pool.free_list.push_back(buffer);
+        pthread_cond_signal(&merge_pool.available);
+        pthread_mutex_unlock(&merge_pool.mutex);
+    }
+
+    // MDTS sized buffers writers stage log appends in, one per writer in flight. Unlike the merge buffers they are
+    // never waited for, a writer may hold one while it waits for the gc that needs the merge buffers.
+    struct staging_pool
+    {
+        std::vector<char *> free_list;
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    } staging_pool;
+
+    char *staging_buffer_get()
+    {
+        pthread_mutex_lock(&staging_pool.mutex);
+        char *buffer = NULL;
+        if (!staging_pool.free_list.empty())
+        {
+            buffer = staging_pool.free_list.back();
+            staging_pool.free_list.pop_back();
+        }
+        pthread_mutex_unlock(&staging_pool.mutex);
+        return buffer ? buffer : (char *)malloc(zns_dev_ex->mdts);
+    }
+
+    void staging_buffer_put(char *buffer)
+    {
+        if (!buffer)
+            return;
+        pthread_mutex_lock(&staging_pool.mutex);
+        staging_pool.free_list.push_back(buffer);
+        pthread_mutex_unlock(&staging_pool.mutex);
+    }
+
+    void staging_pool_free()
+    {
+        for (auto iter = staging_pool.free_list.begin(); iter != staging_pool.free_list.end(); iter++)
+            free(*iter);
+        staging_pool.free_list.clear();
+    }
+
+    // the single in-flight write of a pipelined zone fill
+    struct merge_write
+    {
+        pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+        pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+        bool pending = false;
+        int status = 0;
+    };
+
+    // a plain write has no result, its status fails the fill in merge_write_wait
+    void merge_write_done(void *ctx, int status, uint64_t)
+    {
+        struct merge_write *write = (struct merge_write *)ctx;
+        pthread_mutex_lock(&write->mutex);
+        write->status = status;
+        write->pending = false;
+        pthread_cond_signal(&write->done);
+        pthread_mutex_unlock(&write->mutex);
+    }
+
+    int merge_write_wait(struct merge_write *write)
+    {
+        pthread_mutex_lock(&write->mutex);
+        while (write->pending)
+            pthread_cond_wait(&write->done, &write->mutex);
+        int ret = write->status;
+        pthread_mutex_unlock(&write->mutex);
+        return ret;
+    }
+
+    // read up to one MDTS of source blocks into buffer, runs that are consecutive on the device take one command
+    int merge_gather(const uint32_t *run, uint64_t n, char *buffer)
+    {
+        uint64_t lsb = zns_dev->lba_size_bytes, i, j;
+        int ret = 0;
+        for (i = 0; i < n && !ret; i = j)
+        {
+            for (j = i + 1; j < n; j++)
+            {
+                if (run[i] == MAP_INVALID ? run[j] != MAP_INVALID : run[j] == MAP_INVALID || run[j] != run[i] + (j - i))
+                    break;
+            }
+            if (run[i] == MAP_INVALID)
+                memset(buffer + i * lsb, 0, (j - i) * lsb);
+            else
+                ret = ss_nvme_device_io_with_mdts(run[i], buffer + i * lsb, (j - i) * lsb, true);
+        }
+        return ret;
+    }
+
+    // Host side of zone_fill_range, double buffered: the next MDTS chunk is read while the previous one is written
+    // through the I/O engine. A zone only takes writes at its write pointer, so at most one write is in flight.
+    int zone_fill_host(uint64_t slba, const uint32_t *src, uint64_t blocks)
+    {
+        uint64_t lsb = zns_dev->lba_size_bytes, chunk = zns_dev_ex->mdts / lsb, n;
+        char *buffers[2] = {merge_buffer_get(), merge_buffer_get()};
+        struct merge_write write;
+
+        int ret = 0;
+        for (uint64_t done = 0, k = 0; done < blocks && !ret; done += n, k++)
+        {
+            // the write that used this buffer was waited for in the previous round
+            char *buffer = buffers[k % 2];
+            n = blocks - done < chunk ? blocks - done : chunk;
+            ret = merge_gather(src + done, n, buffer);
+            if (!ret)
+                ret = merge_write_wait(&write);
+            if (ret)
+                break;
+
+            write.pending = true;
+            ret = ss_io_engine_submit(zns_dev_ex->io_engine, SS_IO_WRITE, slba + done, buffer, n * lsb, merge_write_done, &write);
+            if (ret)
+                write.pending = false;
+            else
+                stats_add(&ftl_stats.device_bytes_written, n * lsb);
+        }
+        int last = merge_write_wait(&write);
+
+        merge_buffer_put(buffers[0]);
+        merge_buffer_put(buffers[1]);
+        return ret ? ret : last;
+    }
+
+    // write pointer of the zone holding slba as the device reports it
+    int zone_report_wp(uint64_t slba, uint64_t *wp)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        char buffer[sizeof(struct nvme_zone_report) + sizeof(struct nvme_zns_desc)];
+        struct nvme_zone_report *report = (struct nvme_zone_report *)buffer;
+        int ret = nvme_zns_mgmt_recv(zns_dev_ex->fd, zns_dev_ex->nsid, slba / bpz * bpz, NVME_ZNS_ZRA_REPORT_ZONES,
+                                     NVME_ZNS_ZRAS_REPORT_ALL, 1, sizeof(buffer), (void *)buffer);
+        if (ret)
+            return ret;
+        *wp = (report->entries[0].zs >> 4) == FULL ? slba / bpz * bpz + bpz : report->entries[0].wp;
+        return 0;
+    }
+
+    // Write `blocks` blocks at the write pointer `slba` of a zone, block i is copied from LBA src[i] or zeroed for
+    // MAP_INVALID. With Simple Copy the data never leaves the device, the copy ranges follow the runs of consecutive
+    // source LBAs within the MSRC/MSSRL/MCL limits of the namespace. Zeroed runs and controllers without Simple Copy
+    // go through host memory. A failing copy disables Simple Copy for the rest of the session, the host goes on from
+    // where the zone's write pointer says the copy got to.
+    int zone_fill_range(uint64_t slba, const uint32_t *src, uint64_t blocks)
+    {
+        struct zns_device_extra_info *info = zns_dev_ex;
+        uint64_t i = 0, j;
+        while (i < blocks && info->simple_copy)
+        {
+            if (src[i] == MAP_INVALID)
+            {
+                for (j = i + 1; j < blocks && src[j] == MAP_INVALID; j++)
+                    ;
+                int ret = zone_fill_host(slba + i, src + i, j - i);
+                if (ret)
+                    return ret;
+                i = j;
+                continue;
+            }
+
+            std::vector<__u16> nlbs;
+            std::vector<__u64> slbas;
+            uint64_t total = 0;
+            for (j = i; j < blocks && src[j] != MAP_INVALID && nlbs.size() < info->copy_max_ranges && total < info->copy_max_len;)
+            {
+                uint64_t limit = info->copy_max_len - total < info->copy_max_range_len ? info->copy_max_len - total : info->copy_max_range_len;
+                uint64_t k = j + 1;
+                while (k < blocks && k - j < limit && src[k] != MAP_INVALID && src[k] == src[j] + (k - j))
+                    k++;
+                nlbs.push_back(k - j - 1);
+                slbas.push_back(src[j]);
+                total += k - j;
+                j = k;
+            }
+
+            std::vector<__u32> zero(nlbs.size(), 0);
+            std::vector<struct nvme_copy_range> ranges(nlbs.size());
+            nvme_init_copy_range(ranges.data(), nlbs.data(), slbas.data(), zero.data(), zero.data(), zero.data(), nlbs.size());
+            int ret = nvme_copy(info->fd, info->nsid, ranges.data(), slba + i, nlbs.size(), 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+            if (ret)
+            {
+                printf("INFO: simple copy to 0x%lx failed, ret: %d, the gc falls back to host copies\n", slba + i, ret);
+                info->simple_copy = false;
+                // the copy may have written part of the ranges before it failed
+                uint64_t wp;
+                if ((ret = zone_report_wp(slba + i, &wp)))
+                    return ret;
+                if (wp < slba + i || wp > slba + i + total)
+                {
+                    printf("ERROR: write pointer 0x%lx is off the failed copy to 0x%lx\n", wp, slba + i);
+                    return -EIO;
+                }
+                stats_add(&ftl_stats.device_bytes_written, (wp - slba - i) * zns_dev->lba_size_bytes);
+                stats_add(&ftl_stats.copy_bytes_written, (wp - slba - i) * zns_dev->lba_size_bytes);
+                i = wp - slba;
+                break;
+            }
+            stats_add(&ftl_stats.device_bytes_written, total * zns_dev->lba_size_bytes);
+            stats_add(&ftl_stats.copy_bytes_written, total * zns_dev->lba_size_bytes);
+            i = j;
+        }
+        return i < blocks ? zone_fill_host(slba + i, src + i, blocks - i) : 0;
+    }
+
+    // zone_fill_range with the zone opened within the open and active zone limits
+    int zone_fill(uint64_t slba, const uint32_t *src, uint64_t blocks)
+    {
+        uint32_t zone = slba / zns_dev_ex->blocks_per_zone;
+        int ret = ss_zone_write_begin(zns_dev_ex->zone_mgr, zone);
+        if (!ret)
+            ret = zone_fill_range(slba, src, blocks);
+        ss_zone_write_end(zns_dev_ex->zone_mgr, zone, ret ? 0 : blocks);
+        return ret;
+    }
+
+    // Caller holds gc_mutex, ends a stream short of the end of its data zone. Its length is journaled before the zone
+    // manager may finish the zone, after that the write pointer no longer tells where the data ends.
+    int seq_end(struct seq_stream *stream)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone;
+        meta_log_delta(DELTA_DATA_WRITTEN, stream->zone_no, stream->wp, 1);
+        stream->zone_no = -1;
+        int ret = meta_commit();
+        if (!ret)
+            ss_zone_idle(zns_dev_ex->zone_mgr, stream->zslba / bpz);
+        zns_dev_ex->zone_states[stream->zslba / bpz] = FULL;
+        pthread_cond_broadcast(&seq_done);
+        return ret;
+    }
+
+    // caller holds gc_mutex, ends the stream of a logical zone before a merge reads its data zone, the merge takes
+    // the first data_written blocks of it
+    int seq_retire(uint64_t zone_no)
+    {
+        struct seq_stream *stream;
+        while ((stream = seq_find(zone_no)) && stream->busy)
+            pthread_cond_wait(&seq_done, &zns_dev_ex->gc_mutex);
+        return stream ? seq_end(stream) : 0;
+    }
+
+    // Caller holds gc_mutex. Opens a stream on a reset zone and journals it as the data zone of zone_no, -ENOSPC if
+    // no reset zone is ready. With every slot taken the least recently written stream is ended to make room, -EAGAIN
+    // tells the caller to look again as gc_mutex was dropped while waiting for a busy one.
+    int seq_open(uint64_t zone_no)
+    {
+        struct seq_stream *stream = NULL;
+        if (zone_pool.empty())
+            return -ENOSPC;
+        for (int i = 0; i < seq_stream_max; i++)
+        {
+            struct seq_stream *slot = &seq_streams[i];
+            if (slot->zone_no == -1)
+            {
+                stream = slot;
+                break;
+            }
+            if (!slot->busy && (!stream || slot->last_write < stream->last_write))
+                stream = slot;
+        }
+        if (!stream)
+        {
+            pthread_cond_wait(&seq_done, &zns_dev_ex->gc_mutex);
+            return -EAGAIN;
+        }
+        int ret;
+        if (stream->zone_no != -1 && (ret = seq_end(stream)))
+            return ret;
+
+        int64_t zslba = zone_pool_take();
+        if (zslba == -1)
+            return -ENOSPC;
+        zns_dev_ex->zone_states[zslba / zns_dev_ex->blocks_per_zone] = OPEN;
+        stream->zone_no = zone_no;
+        stream->zslba = zslba;
+        stream->wp = 0;
+        stream->busy = false;
+        // data_written is 0 without a data zone, readers find nothing in it yet
+        __atomic_store_n(&data_mapping[zone_no], (uint32_t)zslba, __ATOMIC_RELEASE);
+        meta_log_delta(DELTA_DATA_MAP, zone_no, zslba, 1);
+        return meta_commit();
+    }
+
+    // Writes the front of a write at address that starts or continues a sequential stream straight into the data
+    // zone of the stream, done is set to the blocks taken. The rest of the write is for the log.
+    int seq_write(struct zns_device_extra_info *info, uint64_t address, char *buffer, uint32_t blocks, uint32_t *done)
+    {
+        uint64_t lbs = zns_dev->lba_size_bytes, bpz = info->blocks_per_zone, n;
+        int ret = 0;
+        *done = 0;
+        if (!seq_stream_max)
+            return 0;
+        pthread_mutex_lock(&info->gc_mutex);
+        while (*done < blocks && !ret)
+        {
+            uint64_t addr = address + (uint64_t)*done * lbs, zone_no = address_2_zone(addr), offset = address_2_offset(addr);
+            struct seq_stream *stream = seq_find(zone_no);
+            if (stream && stream->busy)
+            {
+                pthread_cond_wait(&seq_done, &info->gc_mutex);
+                continue;
+            }
+            // a log copy would shadow what the stream writes behind it
+            if (__atomic_load_n(&log_mapping[zone_no], __ATOMIC_ACQUIRE) || (stream && stream->wp != offset))
+                break;
+            // a single block at the start of a zone is left to the log, it takes no zone and ends no stream for it
+            if (!stream && (offset || data_mapping[zone_no] != MAP_INVALID || blocks - *done < 2))
+                break;
+            if (!stream)
+            {
+                ret = seq_open(zone_no);
+                if (ret == -ENOSPC)
+                {
+                    // the log takes it, the pool is left to the merges
+                    ret = 0;
+                    break;
+                }
+                ret = ret == -EAGAIN ? 0 : ret;
+                continue;
+            }
+
+            n = std::min((uint64_t)blocks - *done, std::min(bpz - offset, info->mdts / lbs));
+            stream->busy = true;
+            stream->last_write = ++seq_clock;
+            uint64_t slba = stream->zslba + offset;
+            pthread_mutex_unlock(&info->gc_mutex);
+            ret = ss_zone_write_begin(info->zone_mgr, slba / bpz);
+            if (!ret)
+                ret = ss_nvme_device_io_with_mdts(slba, buffer + (uint64_t)*done * lbs, n * lbs, false);
+            ss_zone_write_end(info->zone_mgr, slba / bpz, ret ? 0 : n);
+            pthread_mutex_lock(&info->gc_mutex);
+            stream->busy = false;
+            if (ret)
+            {
+                // the gc merges what made it into the zone
+                printf("ERROR: failed to write data zone at 0x%lx, ret: %d\n", slba, ret);
+                seq_end(stream);
+            }
+            else
+            {
+                stream->wp += n;
+                __atomic_store_n(&data_written[zone_no], stream->wp, __ATOMIC_RELEASE);
+                if (read_cache)
+                    ss_cache_invalidate(read_cache, addr / lbs, n);
+                stats_add(&ftl_stats.seq_bytes_written, n * lbs);
+                *done += n;
+                if (stream->wp == bpz)
+                {
+                    info->zone_states[stream->zslba / bpz] = FULL;
+                    stream->zone_no = -1;
+                }
+            }
+            pthread_cond_broadcast(&seq_done);
+        }
+        pthread_mutex_unlock(&info->gc_mutex);
+        return ret;
+    }
+
+    // Caller holds gc_mutex. Claims an empty data zone for a merge, the gc reserve only as the last resort. When
+    // every zone is taken by merges still in flight or waits for its reset, wait for one to come back. Past
+    // merge_zone_max merges in flight the device has no open zone left for another one, wait for one to finish.
+    int64_t merge_claim_zone(bool use_reserve)
+    {
+        int64_t zone, nlb = zns_dev_ex->blocks_per_zone;
+        while (merges_in_flight >= merge_zone_max)
+            pthread_cond_wait(&merge_zone_freed, &zns_dev_ex->gc_mutex);
+        while ((zone = zone_pool_take()) == -1)
+        {
+            if (use_reserve && gc_reserve_zone != -1)
+            {
+                zone = gc_reserve_zone * nlb;
+                gc_reserve_zone = -1;
+                break;
+            }
+            if (!merges_in_flight && zone_dirty.empty() && !zones_resetting)
+                return -1;
+            pthread_cond_wait(&merge_zone_freed, &zns_dev_ex->gc_mutex);
+        }
+        zns_dev_ex->zone_states[zone / nlb] = OPEN;
+        merges_in_flight++;
+        return zone;
+    }
+
+    void merge_release_zone()
+    {
+        merges_in_flight--;
+        pthread_cond_broadcast(&merge_zone_freed);
+    }
+
+    // Caller holds gc_mutex. Points a logical zone at its new data zone and drops the merged log entries, the change
+    // is journaled before the old data zone is released to the resetter, or reset right away if the caller reuses it.
+    int merge_commit(uint64_t zone_no, uint64_t zslba, const uint32_t *snapshot, int64_t old_zone, bool reuse_old)
+    {
+        // log summaries are replayed in log clock order against the journal, so every append reserved before the
+        // commit has to be mapped before it
+        if (zns_dev_ex->log_summaries)
+        {
+            commits_waiting++;
+            while (__atomic_load_n(&zns_dev_ex->inflight_appends, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&appends_drained, &zns_dev_ex->gc_mutex);
+        }
+        // the data zone goes first, a reader that finds a log entry cleared must find the new zone
+        pthread_mutex_lock(&map_mutex);
+        meta_log_delta(DELTA_CLOCK, (uint32_t)log_clock, log_clock >> 32, 0);
+        __atomic_store_n(&data_mapping[zone_no], (uint32_t)zslba, __ATOMIC_RELEASE);
+        __atomic_store_n(&data_written[zone_no], (uint32_t)zns_dev_ex->blocks_per_zone, __ATOMIC_RELEASE);
+        meta_log_delta(DELTA_DATA_MAP, zone_no, zslba, 1);
+        log_merge_commit(zone_no, snapshot);
+        pthread_mutex_unlock(&map_mutex);
+        int ret = meta_commit();
+        if (!ret && old_zone != -1)
+            gc_read_synchronize(zns_dev_ex);
+        if (!ret && old_zone != -1 && reuse_old)
+            ret = zone_reset(old_zone / zns_dev_ex->blocks_per_zone);
+        else if (!ret && old_zone != -1)
+            zone_release(old_zone / zns_dev_ex->blocks_per_zone);
+        if (zns_dev_ex->log_summaries)
+        {
+            commits_waiting--;
+            pthread_cond_broadcast(&appends_drained);
+        }
+        return ret;
+    }
+
+    // A switch merge applies when the victim log zone holds nothing but an in-order prefix of one logical zone
+    // (all of it for a plain switch, the first log_wp blocks for a partial merge). The tail still lives in the data
+    // zone and is appended behind the prefix, then the log zone becomes the data zone without copying the prefix.
+    // The summary blocks break the in-order layout, so with log summaries it never applies.
+    bool can_switch_merge(uint64_t zone_no, int64_t victim)
+    {
+        uint64_t bpz = zns_dev_ex->blocks_per_zone, zslba = (uint64_t)log_zone_phys[victim] * bpz;
+        pthread_mutex_lock(&map_mutex);
+        uint32_t *leaf = log_mapping[zone_no];
+        bool in_order = leaf && log_valid[victim] == log_wp[victim] && log_mapping_count[zone_no] == log_wp[victim];
+        for (uint64_t i = 0; in_order && i < log_wp[victim]; i++)
+            in_order = leaf[i] == zslba + i;
+        pthread_mutex_unlock(&map_mutex);
+        if (!in_order)
+            return false;
+        // the tail goes behind the prefix, unless the zone was finished while it sat sealed
+        return log_wp[victim] == bpz || ss_zone_claim(zns_dev_ex->zone_mgr, zslba / bpz);
+    }
+
+    // caller holds gc_mutex, it is dropped while data moves
+    int do_switch_merge(uint64_t zone_no, int64_t victim, const uint32_t *snapshot)
+    {
+        int64_t ret = 0, nlb = zns_dev_ex->blocks_per_zone;
+        uint64_t zslba = (uint64_t)log_zone_phys[victim] * nlb, prefix = log_wp[victim], tail = nlb - prefix;
+        int64_t old_zone = data_mapping[zone_no] == MAP_INVALID ? -1 : (int64_t)data_mapping[zone_no];
+        // a reset zone takes the place of the log zone, the old data zone only if the pool has none ready
+        int64_t next = old_zone == -1 ? merge_claim_zone(false) : zone_pool_take();
+        bool reuse_old = next == -1 && old_zone != -1;
+        if (reuse_old)
+            next = old_zone;
+        else if (next == -1)
+        {
+            if (tail)
+                ss_zone_idle(zns_dev_ex->zone_mgr, zslba / nlb);
+            return -ENOSPC;
+        }
+
+        if (tail)
+        {
+            // partial merge, the blocks behind the prefix come from the data zone or read as zeroes
+            std::vector<uint32_t> src(tail, MAP_INVALID);
+            for (uint64_t i = 0; old_zone != -1 && i < tail && prefix + i < data_written[zone_no]; i++)
+                src[i] = old_zone + prefix + i;
+            pthread_mutex_unlock(&zns_dev_ex->gc_mutex);
+            ret = zone_fill(zslba + prefix, src.data(), tail);
+            pthread_mutex_lock(&zns_dev_ex->gc_mutex);
+            if (ret)
+            {
+                printf("ERROR: failed to fill the tail of log zone at 0x%lx, ret: %ld, during partial merge\n", zslba, ret);
+                if (old_zone == -1)
+                    merge_release_zone();
+                return ret;
+            }
+        }
+
+        ret = merge_commit(zone_no, zslba, snapshot, old_zone, reuse_old);
+        if (old_zone == -1)
+            merge_release_zone();
+        if (ret)
+            return ret;
+        stats_add(tail ? &ftl_stats.partial_merges : &ftl_stats.switch_merges, 1);
+        zns_dev_ex->zone_states[zslba / nlb] = FULL;
+        pthread_mutex_lock(&map_mutex);
+        zone_log_slot[zslba / nlb] = -1;
+        log_slot_assign(victim, next / nlb);
+        pthread_mutex_unlock(&map_mutex);
+        zns_dev_ex->zone_states[next / nlb] = EMPTY;
+        log_wp[victim] = 0;
+        return 0;
+    }
+
+    // Merge one logical zone into a fresh data zone, caller holds gc_mutex. The mutex is dropped while data moves,
+    // so the log entries are snapshotted first and only the ones that were not rewritten meanwhile are dropped.
+    int merge_zone(uint64_t zone_no, int64_t victim)
+    {
+        int64_t ret, nlb = zns_dev_ex->blocks_per_zone;
+        if ((ret = seq_retire(zone_no)))
+            return ret;
+        pthread_mutex_lock(&map_mutex);
+        std::vector<uint32_t> snapshot;
+        if (log_mapping[zone_no])
+            snapshot.assign(log_mapping[zone_no], log_mapping[zone_no] + nlb);
+        pthread_mutex_unlock(&map_mutex);
+        if (snapshot.empty())
+            return 0;
+        if (can_switch_merge(zone_no, victim))
+            return do_switch_merge(zone_no, victim, snapshot.data());
+
+        int64_t new_zone = merge_claim_zone(true);
+        if (new_zone == -1)
+            return -ENOSPC;
+        int64_t old_zone = data_mapping[zone_no] == MAP_INVALID ? -1 : (int64_t)data_mapping[zone_no];
+
+        // every block comes from the log if it has a copy there, else from the old data zone, else it reads as zero
+        std::vector<uint32_t> src(snapshot);
+        for (int64_t i = 0; old_zone != -1 && i < data_written[zone_no]; i++)
+        {
+            if (src[i] == MAP_INVALID)
+                src[i] = old_zone + i;
+        }
+        pthread_mutex_unlock(&zns_dev_ex->gc_mutex);
+        ret = zone_fill(new_zone, src.data(), nlb);
+        pthread_mutex_lock(&zns_dev_ex->gc_mutex);
+        if (ret)
+        {
+            printf("ERROR: failed to write zone at 0x%lx, ret: %ld, during full merge\n", new_zone, ret);
+            merge_release_zone();
+            return ret;
+        }
+
+        ret = merge_commit(zone_no, new_zone, snapshot.data(), old_zone, false);
+        zns_dev_ex->zone_states[new_zone / nlb] = FULL;
+        merge_release_zone();
+        if (ret)
+            return ret;
+        stats_add(&ftl_stats.full_merges, 1);
+        if (gc_reserve_zone == -1)
+        {
+            ret = zone_pool_take();
+            gc_reserve_zone = ret == -1 ? -1 : ret / nlb;
+        }
+        return 0;
+    }
+
+    // Merge workers take the logical zones of one gc round off a shared list. They all run under gc_mutex and drop
+    // it only while data moves, so zone allocation and the mapping updates stay serialised.
+    void *merge_worker_loop(void *args)
+    {
+        struct zns_device_extra_info *info = (struct zns_device_extra_info *)args;
+        pthread_mutex_lock(&info->gc_mutex);
+        while (1)
+        {
+            while (!merge_workers_stop && (!merge_job.zones || merge_job.next == merge_job.zones->size()))
+                pthread_cond_wait(&merge_job.wakeup, &info->gc_mutex);
+            if (merge_workers_stop)
+                break;
+
+            uint64_t zone_no = (*merge_job.zones)[merge_job.next++];
+            int ret = merge_zone(zone_no, merge_job.victim);
+            if (ret && !merge_job.status)
+                merge_job.status = ret;
+            if (++merge_job.done == merge_job.zones->size())
+                pthread_cond_signal(&merge_job.finished);
+        }
+        pthread_mutex_unlock(&info->gc_mutex);
+        return (void *)0;
+    }
+
+    int merge_workers_start(struct zns_device_extra_info *info, int count)
+    {
+        merge_workers_stop = false;
+        for (int i = 0; i < count; i++)
+        {
+            pthread_t thread;
+            int ret = pthread_create(&thread, NULL, &merge_worker_loop, info);
+            if (ret)
+                return ret;
+            merge_workers.push_back(thread);
+        }
+        return 0;
+    }
+
+    void merge_workers_join(struct zns_device_extra_info *info)
+    {
+        pthread_mutex_lock(&info->gc_mutex);
+        merge_workers_stop = true;
+        pthread_cond_broadcast(&merge_job.wakeup);
+        pthread_mutex_unlock(&info->gc_mutex);
+        for (auto iter = merge_workers.begin(); iter != merge_workers.end(); iter++)
+            pthread_join(*iter, NULL);
+        merge_workers.clear();
+    }
+
+    // caller holds gc_mutex, hands the zones to the merge workers and waits until all of them are merged
+    int do_merge(std::vector<uint64_t> *zone_sets_ptr, int64_t victim)
+    {
+        if (zone_sets_ptr->empty())
+            return 0;
+        uint64_t start = ss_lat_now();
+        merge_job.zones = zone_sets_ptr;
+        merge_job.victim = victim;
+        merge_job.next = merge_job.done = 0;
+        merge_job.status = 0;
+        pthread_cond_broadcast(&merge_job.wakeup);
+        while (merge_job.done < zone_sets_ptr->size())
+            pthread_cond_wait(&merge_job.finished, &zns_dev_ex->gc_mutex);
+        merge_job.zones = NULL;
+        ss_lat_record(ZNS_LAT_MERGE, start);
+        return merge_job.status;
+    }
+
+    // cost-benefit victim selection: prefer sealed log zones with few live blocks that have not been written to for
+    // a long time, i.e. maximise (1 - u) * age / (1 + u) with u the fraction of live blocks
+    int64_t gc_pick_victim(bool seal_active)
+    {
+        int64_t victim = -1;
+        double best = -1, bpz = zns_dev_ex->blocks_per_zone;
+        pthread_mutex_lock(&map_mutex);
+        for (int64_t i = 0; i < log_slot_num; i++)
+        {
+            if (zns_dev_ex->zone_states[log_zone_phys[i]] != FULL)
+                continue;
+            double u = log_valid[i] / bpz, age = log_clock - log_stamp[i] + 1;
+            double score = (1 - u) * age / (1 + u);
+            // hot zones go first, merging them flushes the zones that will be overwritten again anyway
+            if (log_stream_num > 1 && log_slot_stream[i] == LOG_STREAM_HOT)
+                score *= LOG_HOT_VICTIM_BIAS;
+            if (score > best)
+            {
+                best = score;
+                victim = i;
+            }
+        }
+        pthread_mutex_unlock(&map_mutex);
+
+        // nothing sealed yet and writers are stuck, give up the rest of the fullest active zone
+        int head = -1;
+        for (int i = 0; victim == -1 && seal_active && i < log_head_num; i++)
+        {
+            if (active_log_zone[i] != -1 && (head == -1 || log_wp[active_log_zone[i]] > log_wp[active_log_zone[head]]))
+                head = i;
+        }
+        if (head != -1)
+        {
+            victim = active_log_zone[head];
+            log_seal_zone(head);
+        }
+        return victim;
+    }
+
+    // merge the logical zones that still have live blocks in one victim log zone, then reset it
+    int gc_reclaim_zone(struct zns_device_extra_info *info)
+    {
+        int64_t victim = gc_pick_victim(info->gc_waiters > 0);
+        if (victim == -1)
+            return -ENOSPC;
+        stats_add(&ftl_stats.gc_invocations, 1);
+
+        uint64_t bpz = info->blocks_per_zone;
+        std::vector<uint64_t> zone_sets;
+        pthread_mutex_lock(&map_mutex);
+        for (uint64_t i = victim * bpz; log_valid[victim] && i < (victim + 1) * bpz; i++)
+        {
+            if (log_reverse[i] != MAP_INVALID)
+                zone_sets.push_back(log_reverse[i] / bpz);
+        }
+        pthread_mutex_unlock(&map_mutex);
+        std::sort(zone_sets.begin(), zone_sets.end());
+        zone_sets.erase(std::unique(zone_sets.begin(), zone_sets.end()), zone_sets.end());
+
+        // the victim is sealed, so no writer touches it while the mutex is dropped during the merge
+        gc_victim_slot = victim;
+        int ret = do_merge(&zone_sets, victim);
+
+        // a switch merge already swapped an empty zone into the slot, otherwise a reset zone from the pool takes the
+        // victim's place and the resetter gets the victim. Only with the pool empty is the victim reset in place.
+        uint64_t zone = log_zone_phys[victim];
+        if (!ret && info->zone_states[zone] != EMPTY)
+        {
+            int64_t next = zone_pool_take();
+            gc_read_synchronize(info);
+            if (next == -1)
+                ret = zone_reset(zone);
+            else
+            {
+                pthread_mutex_lock(&map_mutex);
+                zone_log_slot[zone] = -1;
+                log_slot_assign(victim, next / bpz);
+                pthread_mutex_unlock(&map_mutex);
+                zone_release(zone);
+            }
+        }
+        gc_victim_slot = -1;
+        if (ret)
+            return ret;
+        log_free_num++;
+        return 0;
+    }
+
+    // Static wear leveling, caller holds gc_mutex. The least worn data zone of a logical zone without log entries
+    // holds cold data, once the most worn zone of the pool is wear_level_threshold resets ahead of it the data moves
+    // there and the little worn zone goes back to the pool for the hot data.
+    int wear_level_step(struct zns_device_extra_info *info)
+    {
+        uint64_t bpz = info->blocks_per_zone;
+        int64_t zone_no = -1;
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            if (data_mapping[i] == MAP_INVALID || __atomic_load_n(&log_mapping[i], __ATOMIC_ACQUIRE) || data_written[i] < bpz)
+                continue;
+            if (zone_no == -1 || zone_resets[data_mapping[i] / bpz] < zone_resets[data_mapping[zone_no] / bpz])
+                zone_no = i;
+        }
+        if (zone_no == -1 || zone_pool.empty())
+            return 0;
+        int64_t old_zone = data_mapping[zone_no];
+        auto worn = std::prev(zone_pool.end());
+        if (worn->first < zone_resets[old_zone / bpz] + info->wear_level_threshold)
+            return 0;
+
+        int64_t new_zone = (int64_t)worn->second * bpz;
+        zone_pool.erase(worn);
+        info->zone_states[new_zone / bpz] = OPEN;
+        merges_in_flight++;
+        std::vector<uint32_t> src(bpz), snapshot(bpz, MAP_INVALID);
+        for (uint64_t i = 0; i < bpz; i++)
+            src[i] = old_zone + i;
+        pthread_mutex_unlock(&info->gc_mutex);
+        int ret = zone_fill(new_zone, src.data(), bpz);
+        pthread_mutex_lock(&info->gc_mutex);
+        if (ret)
+        {
+            printf("ERROR: failed to write zone at 0x%lx, ret: %d, during wear leveling\n", new_zone, ret);
+            zone_release(new_zone / bpz);
+        }
+        else
+        {
+            // log entries written meanwhile stay in front of the data zone
+            ret = merge_commit(zone_no, new_zone, snapshot.data(), old_zone, false);
+            info->zone_states[new_zone / bpz] = FULL;
+            if (!ret)
+                stats_add(&ftl_stats.wear_level_moves, 1);
+        }
+        merge_release_zone();
+        return ret;
+    }
+
+    void *gc_loop(void *args)
+    {
+        struct zns_device_extra_info *info = (struct zns_device_extra_info *)args;
+        pthread_mutex_lock(&info->gc_mutex);
+        while (1)
+        {
+            // in-flight appends hold log space that is not mapped yet, let them land first
+            while (!info->gc_thread_stop && (!info->do_gc || __atomic_load_n(&info->inflight_appends, __ATOMIC_SEQ_CST)))
+            {
+                // writers overlap their appends, hold back new ones or the round may never find them drained
+                if (info->do_gc)
+                {
+                    commits_waiting++;
+                    while (__atomic_load_n(&info->inflight_appends, __ATOMIC_SEQ_CST) && !info->gc_thread_stop)
+                        pthread_cond_wait(&appends_drained, &info->gc_mutex);
+                    commits_waiting--;
+                    pthread_cond_broadcast(&appends_drained);
+                    continue;
+                }
+                if (!info->wear_level_threshold)
+                {
+                    pthread_cond_wait(&info->gc_wakeup, &info->gc_mutex);
+                    continue;
+                }
+                // with wear leveling on, a period without appends counts as idle time
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += WEAR_LEVEL_IDLE_MS / 1000;
+                deadline.tv_nsec += (WEAR_LEVEL_IDLE_MS % 1000) * 1000000;
+                if (deadline.tv_nsec >= 1000000000)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000;
+                }
+                uint64_t clock = log_clock;
+                if (pthread_cond_timedwait(&info->gc_wakeup, &info->gc_mutex, &deadline) == ETIMEDOUT &&
+                    clock == log_clock && !info->do_gc && !__atomic_load_n(&info->inflight_appends, __ATOMIC_SEQ_CST) && !info->gc_thread_stop)
+                    wear_level_step(info);
+            }
+
+            if (info->gc_thread_stop)
+                break;
+
+            // reclaim one log zone per round and keep going in the background until the soft watermark is cleared,
+            // writers only wait for the gc below the hard watermark
+            int ret = gc_reclaim_zone(info);
+            if (ret && ret != -ENOSPC)
+            {
+                printf("Error: GC failed, ret:%d\n", ret);
+            }
+            if (ret || get_free_lz_num(0, -1) > info->gc_soft_watermark)
+                info->do_gc = false;
+            pthread_cond_broadcast(&info->gc_sleep);
+        }
+        pthread_mutex_unlock(&info->gc_mutex);
+
+        return (void *)0;
+    }
+
+    int init_ss_zns_device(struct zdev_init_params *params, struct user_zns_device **my_dev)
+    {
+        int fd = nvme_open(params->name);
+        if (fd < 0)
+        {
+            printf("device %s opening failed %d errno %d \n", params->name, fd, errno);
+            return -fd;
+        }
+
+        struct zns_device_extra_info *info = static_cast<struct zns_device_extra_info *>(calloc(sizeof(struct zns_device_extra_info), 1));
+        (*my_dev) = static_cast<struct user_zns_device *>(calloc(sizeof(struct user_zns_device), 1));
+        info->fd = fd;
+        info->gc_watermark = params->gc_wmark;
+        info->gc_soft_watermark = params->gc_soft_wmark;
+        info->log_summaries = params->log_summaries;
+        info->wear_level_threshold = params->wear_level_threshold > 0 ? params->wear_level_threshold : 0;
+        info->log_zone_num_config = params->log_zones;
+        (*my_dev)->_private = info;
+        memset(&ftl_stats, 0, sizeof(ftl_stats));
+
+        int ret = nvme_get_nsid(fd, &(info->nsid));
+        if (ret != 0)
+        {
+            printf("ERROR: failed to retrieve the nsid %d \n", ret);
+            return ret;
+        }
+
+        struct nvme_id_ns ns;
+        ret = nvme_identify_ns(fd, info->nsid, &ns);
+        if (ret)
+        {
+            printf("ERROR: failed to retrieve the nsid struct %d \n", ret);
+            return ret;
+        }
+
+        // the gc moves data with Simple Copy if the controller has it
+        struct nvme_id_ctrl ctrl;
+        ret = nvme_identify_ctrl(fd, &ctrl);
+        info->simple_copy = !ret && (ctrl.oncs & ONCS_SIMPLE_COPY);
+        info->copy_max_ranges = ns.msrc + 1;
+        info->copy_max_range_len = ns.mssrl ? ns.mssrl : 1 << 16;
+        info->copy_max_len = ns.mcl ? ns.mcl : UINT32_MAX;
+
+        // the zones the device lets us keep open and active at once, MOR and MAR are 0's based and all ones if unlimited
+        struct nvme_zns_id_ns zns_ns;
+        ret = nvme_zns_identify_ns(fd, info->nsid, &zns_ns);
+        info->max_open_zones = ret || zns_ns.mor == UINT32_MAX ? UINT32_MAX : zns_ns.mor + 1;
+        info->max_active_zones = ret || zns_ns.mar == UINT32_MAX ? UINT32_MAX : zns_ns.mar + 1;
+
+        if (params->force_reset)
+        {
+            ret = nvme_zns_mgmt_send(fd, info->nsid, 0, true, NVME_ZNS_ZSA_RESET, 0, NULL);
+            if (ret)
+            {
+                printf("ERROR: failed to reset all zones %d \n", ret);
+                return ret;
+            }
+
+            // info->data_zone_start = info->data_zone_end = params->log_zones * blocks_per_zone;
+            info->log_zone_start = info->log_zone_end = 0;
+        }
+
+        (*my_dev)->lba_size_bytes = 1 << ns.lbaf[(ns.flbas & 0xf)].ds;
+        (*my_dev)->tparams.zns_lba_size = (*my_dev)->lba_size_bytes;
+        // info->mdts = get_mdts_size(info->fd, params->name);
+        info->mdts = MDTS;
+
+        ret = ss_io_engine_init(&info->io_engine, params->name, fd, info->nsid, (*my_dev)->lba_size_bytes,
+                                params->io_depth > 0 ? params->io_depth : DEFAULT_IO_DEPTH);
+        if (ret)
+        {
+            printf("ERROR: failed to start the I/O engine %d \n", ret);
+            return ret;
+        }
+
+        // two buffers per merge worker for the double buffered host copies
+        int merge_workers = params->merge_workers > 0 ? params->merge_workers : 1;
+        ret = merge_pool_init(2 * merge_workers, info->mdts);
+        if (ret)
+        {
+            printf("ERROR: failed to allocate the merge buffers %d \n", ret);
+            return ret;
+        }
+
+        struct nvme_zone_report report;
+        ret = nvme_zns_mgmt_recv(fd, info->nsid, 0,
+                                 NVME_ZNS_ZRA_REPORT_ZONES, NVME_ZNS_ZRAS_REPORT_ALL,
+                                 0, sizeof(report), (void *)&report);
+        if (ret != 0)
+        {
+            fprintf(stderr, "failed to report zones, ret %d \n", ret);
+            return ret;
+        }
+
+        (*my_dev)->tparams.zns_num_zones = report.nr_zones;
+        info->zone_states = (uint8_t *)calloc(report.nr_zones, sizeof(uint8_t));
+
+        uint64_t total_size = sizeof(report) + (report.nr_zones * sizeof(struct nvme_zns_desc));
+        char *zone_reports = (char *)calloc(1, total_size);
+        // dont need to report all for milestone 2, but needed for milestone 5
+        ret = nvme_zns_mgmt_recv(fd, info->nsid, 0,
+                                 NVME_ZNS_ZRA_REPORT_ZONES, NVME_ZNS_ZRAS_REPORT_ALL,
+                                 1, total_size, (void *)zone_reports);
+        if (ret)
+        {
+            free(zone_reports);
+            printf("ERROR: failed to get zone reports %d \n", ret);
+            return ret;
+        }
+
+        uint64_t blocks_per_zone = ((struct nvme_zone_report *)zone_reports)->entries[0].zcap;
+        info->blocks_per_zone = blocks_per_zone;
+        (*my_dev)->tparams.zns_zone_capacity = blocks_per_zone * (*my_dev)->lba_size_bytes;
+
+        // The mapping lives in a metadata region at the end of the device. The next checkpoint is written before the
+        // last one is given up, so the region has to hold the largest possible checkpoint twice.
+        uint64_t meta_zones = params->meta_zones > 0 ? params->meta_zones : META_ZONES_DEFAULT;
+        uint64_t ckpt_bytes = meta_checkpoint_max(report.nr_zones, report.nr_zones, 2 * (uint64_t)params->log_zones * blocks_per_zone);
+        uint64_t ckpt_zones = (ckpt_bytes + ckpt_bytes / 64 + (*my_dev)->tparams.zns_zone_capacity - 1) / (*my_dev)->tparams.zns_zone_capacity;
+        if (meta_zones < 2 * ckpt_zones)
+        {
+            printf("INFO: metadata region raised from %lu to %lu zones to fit two checkpoints\n", meta_zones, 2 * ckpt_zones);
+            meta_zones = 2 * ckpt_zones;
+        }
+        // one zone is kept aside as the gc reserve
+        int64_t data_zones = (int64_t)report.nr_zones - params->log_zones - 1 - meta_zones;
+        if (data_zones <= 0)
+        {
+            printf("ERROR: %lu zones leave no room for data next to %d log and %lu metadata zones\n", (uint64_t)report.nr_zones, params->log_zones, meta_zones);
+            free(zone_reports);
+            return -EINVAL;
+        }
+        info->meta_zone_start = report.nr_zones - meta_zones;
+        (*my_dev)->capacity_bytes = data_zones * ((*my_dev)->tparams.zns_zone_capacity);
+
+        // blocks written per zone, what a log scan has to read
+        std::vector<uint32_t> zone_wp(report.nr_zones);
+        for (uint64_t i = 0; i < report.nr_zones; i++)
+        {
+            struct nvme_zns_desc *desc = &((struct nvme_zone_report *)zone_reports)->entries[i];
+            info->zone_states[i] = desc->zs >> 4;
+            zone_wp[i] = info->zone_states[i] == FULL ? blocks_per_zone : desc->wp - desc->zslba;
+        }
+
+        free(zone_reports);
+
+        ret = ss_zone_mgr_init(&info->zone_mgr, fd, info->nsid, info->meta_zone_start, blocks_per_zone,
+                               info->max_open_zones, info->max_active_zones);
+        if (ret)
+        {
+            printf("ERROR: failed to set up the zone manager %d \n", ret);
+            return ret;
+        }
+        for (uint64_t i = 0; i < info->meta_zone_start; i++)
+            ss_zone_mgr_load(info->zone_mgr, i, info->zone_states[i], zone_wp[i]);
+
+        if (report.nr_zones * blocks_per_zone > MAP_INVALID)
+        {
+            printf("ERROR: %lu LBAs do not fit the 32-bit mapping table\n", (uint64_t)(report.nr_zones * blocks_per_zone));
+            return -EINVAL;
+        }
+        zns_dev = *my_dev;
+        zns_dev_ex = info;
+        ret = mapping_init(data_zones, params->log_zones, report.nr_zones);
+        if (ret)
+        {
+            printf("ERROR: failed to allocate the mapping table %d \n", ret);
+            return ret;
+        }
+
+        // restore the mapping from the latest checkpoint and the journal behind it
+        ret = ss_meta_log_init(&info->meta_log, fd, info->nsid, (*my_dev)->lba_size_bytes, blocks_per_zone,
+                               info->meta_zone_start, meta_zones, info->mdts);
+        if (ret)
+        {
+            printf("ERROR: failed to set up the metadata region %d \n", ret);
+            return ret;
+        }
+        ret = ss_meta_log_recover(info->meta_log, meta_apply, NULL);
+        if (ret < 0)
+        {
+            printf("ERROR: failed to recover the mapping %d \n", ret);
+            return ret;
+        }
+        bool checkpoint = ret;
+        if (recovery_summaries && (ret = log_recover_scan(zone_wp, merge_workers)))
+            return ret;
+        // an epoch is journaled in one mode, switching starts a new one
+        checkpoint = checkpoint || recovery_summaries != info->log_summaries;
+        recovery_unmaps.clear();
+        ret = log_zones_init(zone_wp);
+        if (ret)
+            return ret;
+        // a fresh region, a torn journal tail or a new log mode starts over with a checkpoint
+        if (checkpoint && (ret = meta_checkpoint()))
+            return ret;
+        // The data zone of a sequential stream cut short by a crash or the unmount ends at its write pointer, or where
+        // a journaled end put it if the zone manager finished the zone since. The length of a zone still open is
+        // journaled before the zone manager may finish it.
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+        {
+            uint64_t zone = data_mapping[i] / blocks_per_zone;
+            if (data_mapping[i] == MAP_INVALID)
+                continue;
+            data_written[i] = std::min(data_written[i], zone_wp[zone]);
+            if (zone_wp[zone] < blocks_per_zone)
+            {
+                meta_log_delta(DELTA_DATA_WRITTEN, i, data_written[i], 1);
+                info->zone_states[zone] = FULL;
+            }
+        }
+        if ((ret = meta_commit()))
+            return ret;
+        // Zones the device keeps open and active for the FTL, the metadata log has one of its own. Every head keeps
+        // a log zone open, a merge target and the tail of a partial merge take one each next to them.
+        uint32_t zone_limit = std::min(info->max_open_zones, info->max_active_zones);
+        int zone_budget = zone_limit == UINT32_MAX ? INT32_MAX : std::max(1, (int)std::min(zone_limit, (uint32_t)INT32_MAX) - 1);
+        // a second stream needs its own active zone next to a sealed one for the gc and the free ones
+        log_stream_num = 1;
+        if (params->hot_cold_streams && log_slot_num < 4)
+            printf("INFO: hot/cold log streams need at least 4 log zones, %d are available\n", log_slot_num);
+        else if (params->hot_cold_streams && zone_budget < 4)
+            printf("INFO: hot/cold log streams need 4 open zones, the device keeps %d open for the FTL\n", zone_budget);
+        else if (params->hot_cold_streams)
+            log_stream_num = 2;
+        // every lane keeps a log zone open, next to a sealed one for the gc and a free one
+        log_lane_num = params->log_lanes > 1 ? std::min(params->log_lanes, LOG_LANES_MAX) : 1;
+        int lane_max = std::max(1, (log_slot_num - 2) / log_stream_num);
+        if (log_lane_num > lane_max)
+        {
+            printf("INFO: log lanes lowered from %d to %d, the log has %d zones\n", log_lane_num, lane_max, log_slot_num);
+            log_lane_num = lane_max;
+        }
+        lane_max = std::max(1, (zone_budget - 2) / log_stream_num);
+        if (log_lane_num > lane_max)
+        {
+            printf("INFO: log lanes lowered from %d to %d, the device keeps %d zones open for the FTL\n", log_lane_num, lane_max, zone_budget);
+            log_lane_num = lane_max;
+        }
+        log_head_num = log_stream_num * log_lane_num;
+        // a sequential stream keeps its data zone open, the merges get what is left
+        seq_stream_max = params->seq_streams > 0 ? std::min(params->seq_streams, SEQ_STREAMS_MAX) : 0;
+        int seq_max = std::max(0, zone_budget - log_head_num - 2);
+        if (seq_stream_max > seq_max)
+        {
+            printf("INFO: sequential streams lowered from %d to %d, the device keeps %d zones open for the FTL\n", seq_stream_max, seq_max, zone_budget);
+            seq_stream_max = seq_max;
+        }
+        for (int i = 0; i < SEQ_STREAMS_MAX; i++)
+        {
+            seq_streams[i].zone_no = -1;
+            seq_streams[i].busy = false;
+        }
+        seq_clock = 0;
+        merge_zone_max = std::max(1, zone_budget - log_head_num - seq_stream_max - 1);
+        // writers must leave at least one log zone to the gc
+        if (info->gc_watermark >= log_slot_num)
+        {
+            printf("INFO: gc watermark %d lowered to %d, only %d log zones can take writes\n", info->gc_watermark, log_slot_num - 1, log_slot_num);
+            info->gc_watermark = log_slot_num - 1;
+        }
+        if (info->gc_soft_watermark <= info->gc_watermark)
+            info->gc_soft_watermark = info->gc_watermark + 1;
+
+        read_cache = NULL;
+        if (params->read_cache_bytes && (ret = ss_cache_init(&read_cache, params->read_cache_bytes, (*my_dev)->lba_size_bytes)))
+        {
+            printf("ERROR: failed to allocate a read cache of %lu bytes, ret: %d\n", params->read_cache_bytes, ret);
+            return ret;
+        }
+
+        zone_resetter_stop = false;
+        ret = pthread_create(&zone_resetter_id, NULL, &zone_resetter_loop, info);
+        if (ret)
+        {
+            printf("ERROR: failed to create the zone resetter %d \n", ret);
+            return ret;
+        }
+
+        ret = merge_workers_start(info, merge_workers);
+        if (ret)
+        {
+            printf("ERROR: failed to create merge workers %d \n", ret);
+            return ret;
+        }
+
+        ret = pthread_create(&info->gc_thread_id, NULL, &gc_loop, info);
+        if (ret)
+        {
+            printf("ERROR: failed to create gc thread %d \n", ret);
+            return ret;
+        }
+
+        wbuf.capacity = params->write_buffer_bytes / (*my_dev)->lba_size_bytes;
+        if (wbuf.capacity)
+        {
+            wbuf.data[0] = (char *)malloc(wbuf.capacity * (*my_dev)->lba_size_bytes);
+            wbuf.data[1] = (char *)malloc(wbuf.capacity * (*my_dev)->lba_size_bytes);
+            if (!wbuf.data[0] || !wbuf.data[1])
+                return -ENOMEM;
+            wbuf.active = 0;
+            wbuf.drains = 0;
+            wbuf.status = 0;
+            wbuf.stop = false;
+            wbuf.flush_ns = (uint64_t)(params->write_buffer_flush_us > 0 ? params->write_buffer_flush_us : 0) * 1000;
+            ret = pthread_create(&wbuf.flusher, NULL, &write_buffer_flush_loop, info);
+            if (ret)
+            {
+                printf("ERROR: failed to create the write buffer flusher %d \n", ret);
+                return ret;
+            }
+        }
+
+        return 0;
+    }
+
+    // translate a user address into its physical LBA, ENTRY_INVALID if nothing was ever written there
+    uint64_t lookup_lba(uint64_t address)
+    {
+        uint64_t zone_no = address_2_zone(address), offset = address_2_offset(address);
+        uint32_t *leaf = __atomic_load_n(&log_mapping[zone_no], __ATOMIC_ACQUIRE);
+        uint32_t lba = leaf ? __atomic_load_n(&leaf[offset], __ATOMIC_ACQUIRE) : MAP_INVALID;
+        if (lba != MAP_INVALID)
+        {
+            return lba;
+        }
+
+        // a merge publishes the data zone before the whole of it counts as written
+        uint32_t written = __atomic_load_n(&data_written[zone_no], __ATOMIC_ACQUIRE);
+        uint32_t zslba = __atomic_load_n(&data_mapping[zone_no], __ATOMIC_ACQUIRE);
+        if (zslba == MAP_INVALID || offset >= written)
+        {
+            return ENTRY_INVALID;
+        }
+        return zslba + offset;
+    }
+
+    typedef int (*extent_fn)(uint64_t slba, void *buffer, uint64_t size, void *arg);
+
+    // split [address, address + blocks) into runs of consecutive physical LBAs (or holes) and hand each run to fn
+    int walk_extents(uint64_t address, void *buffer, uint32_t blocks, extent_fn fn, void *arg)
+    {
+        int ret;
+        uint64_t lba_s = zns_dev->lba_size_bytes, ext_start = 0, ext_len = 0, num_read = 0;
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            uint64_t lba = lookup_lba(address + i * lba_s);
+            if (ext_len)
+            {
+                bool hole = lba == (uint64_t)ENTRY_INVALID, ext_hole = ext_start == (uint64_t)ENTRY_INVALID;
+                if (hole == ext_hole && (hole || lba == ext_start + ext_len))
+                {
+                    ext_len++;
+                    continue;
+                }
+
+                ret = fn(ext_start, (char *)buffer + num_read, ext_len * lba_s, arg);
+                if (ret)
+                    return ret;
+                num_read += ext_len * lba_s;
+            }
+            ext_start = lba;
+            ext_len = 1;
+        }
+
+        return ext_len ? fn(ext_start, (char *)buffer + num_read, ext_len * lba_s, arg) : 0;
+    }
+
+    // read one run of physically contiguous LBAs, a run starting at ENTRY_INVALID is a hole
+    int read_extent(uint64_t slba, void *buffer, uint64_t size, void *)
+    {
+        if (slba == (uint64_t)ENTRY_INVALID)
+        {
+            // nothing at these addresses
+            memset(buffer, 0, size);
+            return 0;
+        }
+
+        int ret = ss_nvme_device_io_with_mdts(slba, buffer, size, true);
+        if (ret)
+        {
+            printf("ERROR: failed to read extent at 0x%lx, size: %lu, ret: %d\n", slba, size, ret);
+        }
+        return ret;
+    }
+
+    // copies the blocks of [first, first + blocks) that are still in the write buffer, the active half is newer
+    void write_buffer_lookup(uint64_t first, uint32_t blocks, char *buffer, std::vector<bool> *hit)
+    {
+        uint64_t lbs = zns_dev->lba_size_bytes;
+        pthread_mutex_lock(&wbuf.mutex);
+        for (int k = 0; k < 2; k++)
+        {
+            int half = k ? !wbuf.active : wbuf.active;
+            for (auto iter = wbuf.blocks[half].lower_bound(first); iter != wbuf.blocks[half].end() && iter->first < first + blocks; iter++)
+            {
+                if ((*hit)[iter->first - first])
+                    continue;
+                memcpy(buffer + (iter->first - first) * lbs, wbuf.data[half] + (uint64_t)iter->second * lbs, lbs);
+                (*hit)[iter->first - first] = true;
+            }
+        }
+        pthread_mutex_unlock(&wbuf.mutex);
+    }
+
+    // Serves the blocks still in the write buffer, then the ones the read cache holds, and reads every run of the
+    // rest with one walk. The blocks read go into the cache unless a write invalidated them after the lookup, which
+    // came before their mapping was looked up.
+    int read_buffered(uint64_t address, char *buffer, uint32_t blocks)
+    {
+        uint64_t lbs = zns_dev->lba_size_bytes, first = address / lbs;
+        std::vector<uint64_t> tokens(blocks);
+        std::vector<bool> hit(blocks);
+        if (wbuf.capacity)
+            write_buffer_lookup(first, blocks, buffer, &hit);
+        for (uint32_t i = 0; read_cache && i < blocks; i++)
+        {
+            if (!hit[i])
+                hit[i] = ss_cache_lookup(read_cache, first + i, buffer + i * lbs, &tokens[i]);
+        }
+        for (uint32_t i = 0, j; i < blocks; i = j)
+        {
+            for (j = i; j < blocks && !hit[j]; j++)
+                ;
+            if (j == i)
+            {
+                j++;
+                continue;
+            }
+            int ret = walk_extents(address + i * lbs, buffer + i * lbs, j - i, read_extent, NULL);
+            if (ret)
+                return ret;
+            for (uint32_t k = i; read_cache && k < j; k++)
+                ss_cache_fill(read_cache, first + k, buffer + k * lbs, tokens[k]);
+        }
+        return 0;
+    }
+
+    int zns_udevice_read(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size)
+    {
+        if (size % my_dev->lba_size_bytes)
+        {
+            printf("INVALID: read size not aligned to block size\n");
+            return -1;
+        }
+
+        // coalesce the range into extents, one command per extent (split at MDTS)
+        uint64_t start = ss_lat_now();
+        stats_add(&ftl_stats.host_bytes_read, size);
+        uint32_t ticket = gc_read_enter();
+        int ret;
+        if (read_cache || wbuf.capacity)
+            ret = read_buffered(address, (char *)buffer, size / my_dev->lba_size_bytes);
+        else
+            ret = walk_extents(address, buffer, size / my_dev->lba_size_bytes, read_extent, NULL);
+        gc_read_exit(ticket);
+        ss_lat_record(ZNS_LAT_READ, start);
+        return ret;
+    }
+
+    // caller holds gc_mutex. Below the soft watermark the gc is started in the background, below the hard one the
+    // writer waits until the log can take `blocks` more blocks on its head. Larger requests wait zone by zone.
+    void log_wait_for_space(struct zns_device_extra_info *info, uint32_t blocks, int head)
+    {
+        blocks = blocks < info->blocks_per_zone ? blocks : info->blocks_per_zone;
+        if (!info->do_gc && log_sealed_num() && get_free_lz_num(blocks, head) <= info->gc_soft_watermark)
+        {
+            info->do_gc = true;
+            pthread_cond_signal(&info->gc_wakeup);
+        }
+        while (get_free_lz_num(blocks, head) <= info->gc_watermark)
+        {
+            info->do_gc = true;
+            info->gc_waiters++;
+            pthread_cond_signal(&info->gc_wakeup);
+            uint64_t start = ss_lat_now();
+            pthread_cond_wait(&info->gc_sleep, &info->gc_mutex);
+            stats_add(&ftl_stats.writer_block_ns, ss_lat_now() - start);
+            info->gc_waiters--;
+        }
+    }
+
+    // The head a write to address goes to, the lane of its logical zone in its stream.
+    int log_head_of(uint64_t address)
+    {
+        uint64_t zone_no = address_2_zone(address);
+        int lane = zone_no % log_lane_num;
+        if (log_stream_num == 1)
+            return lane;
+        pthread_mutex_lock(&map_mutex);
+        int stream = zone_heat[zone_no] && zone_heat[zone_no] * logical_zone_num >= 2 * heat_total ? LOG_STREAM_HOT : LOG_STREAM_COLD;
+        pthread_mutex_unlock(&map_mutex);
+        return stream * log_lane_num + lane;
+    }
+
+    // caller holds gc_mutex, reserves at most `blocks` log blocks that fit in the active log zone of `head` and one
+    // command, returns the start LBA of the zone to append to and in seq the log clock of the first granted block.
+    // With log summaries the append is one block longer, its summary goes first.
+    uint64_t log_reserve(int head, uint32_t blocks, uint32_t *granted, uint64_t *seq)
+    {
+        uint64_t summary = zns_dev_ex->log_summaries ? 1 : 0, bpz = zns_dev_ex->blocks_per_zone;
+        int64_t &active = active_log_zone[head];
+        if (active != -1 && bpz - log_wp[active] <= summary)
+            log_seal_zone(head);
+        // log_wait_for_space leaves at least one free zone behind, so opening one cannot fail here
+        if (active == -1)
+            log_open_zone(head);
+
+        uint64_t zslba = (uint64_t)log_zone_phys[active] * bpz;
+        uint64_t room = bpz - log_wp[active] - summary;
+        uint64_t max_blocks = zns_dev_ex->mdts / zns_dev->lba_size_bytes - summary;
+        uint64_t summary_max = (zns_dev->lba_size_bytes - sizeof(struct log_summary)) / sizeof(uint32_t);
+        if (summary && max_blocks > summary_max)
+            max_blocks = summary_max;
+        *granted = blocks < room ? blocks : room;
+        *granted = *granted < max_blocks ? *granted : max_blocks;
+
+        *seq = log_clock + summary;
+        log_wp[active] += *granted + summary;
+        zns_dev_ex->log_zone_end = zslba + log_wp[active];
+        log_clock += *granted + summary;
+        if (log_wp[active] == bpz)
+            log_seal_zone(head);
+        return zslba;
+    }
+
+    // Reserves the next append of a write at address, at most `blocks` blocks. gc_mutex is only held for the
+    // reservation, the append goes out without it so writers overlap their device round trips. Until it is mapped
+    // the append counts in inflight_appends, which keeps the gc away from the reserved space.
+    uint64_t log_append_begin(struct zns_device_extra_info *info, uint64_t address, uint32_t blocks, uint32_t *granted,
+                              uint64_t *seq)
+    {
+        pthread_mutex_lock(&info->gc_mutex);
+        int head = log_head_of(address);
+        // merges waiting for the appends in flight to drain go first
+        while (1)
+        {
+            log_wait_for_space(info, blocks, head);
+            if (!commits_waiting)
+                break;
+            pthread_cond_wait(&appends_drained, &info->gc_mutex);
+        }
+        uint64_t zslba = log_reserve(head, blocks, granted, seq);
+        __atomic_add_fetch(&info->inflight_appends, 1, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&info->gc_mutex);
+        return zslba;
+    }
+
+    // caller has mapped the append (or given up on it), lets the gc go after the last one. The waiters check the
+    // count under gc_mutex, so the last one takes it to wake them.
+    void log_append_finish(struct zns_device_extra_info *info)
+    {
+        if (__atomic_sub_fetch(&info->inflight_appends, 1, __ATOMIC_SEQ_CST) == 0)
+        {
+            pthread_mutex_lock(&info->gc_mutex);
+            if (info->do_gc)
+                pthread_cond_signal(&info->gc_wakeup);
+            pthread_cond_broadcast(&appends_drained);
+            pthread_mutex_unlock(&info->gc_mutex);
+        }
+    }
+
+    // fills the summary block of an append of `blocks` user blocks starting at address, reserved at log clock seq
+    void log_summary_fill(char *block, uint64_t seq, uint64_t address, uint32_t blocks)
+    {
+        uint64_t lbs = zns_dev->lba_size_bytes;
+        struct log_summary *sum = (struct log_summary *)block;
+        uint32_t *entries = (uint32_t *)(sum + 1);
+        memset(block, 0, lbs);
+        sum->magic = LOG_SUMMARY_MAGIC;
+        sum->count = blocks;
+        sum->seq = seq;
+        for (uint32_t i = 0; i < blocks; i++)
+            entries[i] = address / lbs + i;
+        sum->crc = ss_meta_crc(0, block, sizeof(*sum) + blocks * sizeof(uint32_t));
+    }
+
+    // caller holds map_mutex, point `blocks` user blocks starting at address to the appended log blocks starting at lba
+    void log_map_range(uint64_t address, uint64_t lba, uint32_t blocks)
+    {
+        for (uint32_t i = 0; i < blocks; i++)
+        {
+            uint64_t addr = address + (uint64_t)i * zns_dev->lba_size_bytes, zone_no = address_2_zone(addr);
+            uint32_t *leaf = log_mapping[zone_no];
+            if (log_stream_num > 1 && leaf && leaf[address_2_offset(addr)] != MAP_INVALID)
+            {
+                zone_heat[zone_no]++;
+                heat_total++;
+            }
+            log_mapping_set(zone_no, address_2_offset(addr), lba + i);
         }
-        return 0;
+        if (read_cache)
+            ss_cache_invalidate(read_cache, address / zns_dev->lba_size_bytes, blocks);
+        // with log summaries the append describes itself
+        if (!zns_dev_ex->log_summaries)
+            meta_log_delta(DELTA_LOG_MAP, address / zns_dev->lba_size_bytes, lba, blocks);
     }
 
-    int init_descriptor(struct zns_device_extra_info *info)
+    // copies a write into the active half of the write buffer, waits while the half is full and the other one is
+    // still being written out. Returns the error of a failed flush nobody was told about yet.
+    int write_buffer_put(uint64_t address, const char *buffer, uint32_t blocks)
     {
-        uint64_t lsb = zns_dev->lba_size_bytes;
-        uint64_t bpz = zns_dev_ex->blocks_per_zone;
-        char buffer[lsb * bpz] = {0};
-        char size_char[lsb];
-
-        if (zns_dev_ex->zone_states[zns_dev->tparams.zns_num_zones - 1] == EMPTY)
+        uint64_t lbs = zns_dev->lba_size_bytes, first = address / lbs;
+        pthread_mutex_lock(&wbuf.mutex);
+        for (uint32_t i = 0; i < blocks; i++)
         {
-            return 0;
+            auto iter = wbuf.blocks[wbuf.active].find(first + i);
+            if (iter != wbuf.blocks[wbuf.active].end())
+                stats_add(&ftl_stats.write_buffer_absorbed, 1);
+            else
+            {
+                while (wbuf.blocks[wbuf.active].size() == wbuf.capacity)
+                {
+                    pthread_cond_signal(&wbuf.wakeup);
+                    pthread_cond_wait(&wbuf.changed, &wbuf.mutex);
+                }
+                std::map<uint64_t, uint32_t> *active = &wbuf.blocks[wbuf.active];
+                if (active->empty())
+                    wbuf.first_write = ss_lat_now();
+                iter = active->insert(std::make_pair(first + i, (uint32_t)active->size())).first;
+            }
+            memcpy(wbuf.data[wbuf.active] + (uint64_t)iter->second * lbs, buffer + (uint64_t)i * lbs, lbs);
         }
+        if (wbuf.blocks[wbuf.active].size() == wbuf.capacity)
+            pthread_cond_signal(&wbuf.wakeup);
+        int ret = wbuf.status;
+        wbuf.status = 0;
+        pthread_mutex_unlock(&wbuf.mutex);
+        return ret;
+    }
 
-        metadata_read(info, size_char, lsb);
-        uint32_t ptr = 0;
-        uint32_t size = *(uint32_t *)(size_char);
-        if (size == 0)
+    // waits until every buffered write is mapped, returns the error of a failed flush nobody was told about yet
+    int write_buffer_drain()
+    {
+        pthread_mutex_lock(&wbuf.mutex);
+        wbuf.drains++;
+        while (!wbuf.blocks[0].empty() || !wbuf.blocks[1].empty())
         {
-            return 0;
+            pthread_cond_signal(&wbuf.wakeup);
+            pthread_cond_wait(&wbuf.changed, &wbuf.mutex);
         }
+        wbuf.drains--;
+        int ret = wbuf.status;
+        wbuf.status = 0;
+        pthread_mutex_unlock(&wbuf.mutex);
+        return ret;
+    }
 
-        metadata_read(info, buffer, roundup(size, lsb));
-
-        info->log_zone_start = *(uint32_t *)(buffer + (ptr += sizeof(uint32_t)));
-        info->log_zone_end = *(uint32_t *)(buffer + (ptr += sizeof(uint32_t)));
-        info->data_zone_start = *(uint32_t *)(buffer + (ptr += sizeof(uint32_t)));
-        info->data_zone_end = *(uint32_t *)(buffer + (ptr += sizeof(uint32_t)));
-
-        ptr += sizeof(uint32_t);
-
-        for (uint64_t i = info->log_zone_num_config; i < zns_dev->tparams.zns_num_zones - 1; i++, ptr += sizeof(uint8_t))
+    int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size)
+    {
+        if (size % my_dev->lba_size_bytes)
         {
-            info->zone_states[i] = *(uint8_t *)(buffer + ptr);
+            printf("INVALID: write size not aligned to block size\n");
+            return -1;
         }
 
-        uint32_t log_mapping_size = *(uint32_t *)(buffer + ptr);
-
-        uint32_t data_mapping_size = *(uint32_t *)(buffer + (ptr += sizeof(int)));
-
-        ptr += sizeof(uint32_t);
-
-        for (int i = 0; i < log_mapping_size; i++, ptr += sizeof(int64_t))
+        struct zns_device_extra_info *info = (struct zns_device_extra_info *)my_dev->_private;
+        uint32_t blocks = size / my_dev->lba_size_bytes, done = 0, granted, summary = info->log_summaries ? 1 : 0;
+        uint64_t lbs = my_dev->lba_size_bytes;
+        int ret = 0;
+        uint64_t start = ss_lat_now();
+        stats_add(&ftl_stats.host_bytes_written, size);
+        // writes below one command go to the write buffer, larger ones are appended once the buffered ones are out
+        if (wbuf.capacity && size < info->mdts && blocks <= wbuf.capacity)
         {
-            int64_t key = *(uint64_t *)(buffer + ptr);
-            int64_t value = *(uint64_t *)(buffer + (ptr += sizeof(int64_t)));
-            log_mapping[key] = value;
+            ret = write_buffer_put(address, (char *)buffer, blocks);
+            ss_lat_record(ZNS_LAT_WRITE, start);
+            return ret;
         }
-
-        for (int i = 0; i < data_mapping_size; i++, ptr += sizeof(int64_t))
+        if (wbuf.capacity)
+            ret = write_buffer_drain();
+        // what starts or continues a sequential stream skips the log
+        if (!ret)
+            ret = seq_write(info, address, (char *)buffer, blocks, &done);
+        char *staging = summary ? staging_buffer_get() : NULL;
+        while (!ret && done < blocks)
         {
-            int64_t key = *(uint64_t *)(buffer + ptr);
-            int64_t value = *(uint64_t *)(buffer + (ptr += sizeof(int64_t)));
-            data_mapping[key] = value;
+            __u64 res_lba;
+            uint64_t seq;
+            uint64_t zslba = log_append_begin(info, address + (uint64_t)done * lbs, blocks - done, &granted, &seq);
+            char *data = (char *)buffer + (uint64_t)done * lbs;
+            if (summary)
+            {
+                log_summary_fill(staging, seq, address + (uint64_t)done * lbs, granted);
+                memcpy(staging + lbs, data, (uint64_t)granted * lbs);
+                data = staging;
+            }
+            uint32_t zone = zslba / info->blocks_per_zone;
+            ret = ss_zone_write_begin(info->zone_mgr, zone);
+            if (!ret)
+                ret = nvme_zns_append(info->fd, info->nsid, zslba, granted + summary - 1, 0, 0, 0, 0,
+                                      (uint64_t)(granted + summary) * lbs, data, 0, NULL, &res_lba);
+            ss_zone_write_end(info->zone_mgr, zone, ret ? 0 : granted + summary);
+            pthread_mutex_lock(&map_mutex);
+            if (!ret)
+                log_map_range(address + (uint64_t)done * lbs, res_lba + summary, granted);
+            pthread_mutex_unlock(&map_mutex);
+            log_append_finish(info);
+            if (ret)
+            {
+                printf("ERROR: failed to append at zone 0x%lx, ret: %d \n", zslba, ret);
+                break;
+            }
+            stats_add(&ftl_stats.device_bytes_written, (uint64_t)(granted + summary) * lbs);
+            done += granted;
         }
 
-        return 0;
+        // one journal record for the whole request, shared with the writers committing alongside
+        int err = meta_sync(false);
+        staging_buffer_put(staging);
+        ss_lat_record(ZNS_LAT_WRITE, start);
+        return ret ? ret : err;
     }
 
-    int restore_descriptor(struct zns_device_extra_info *info)
+    struct read_segment
     {
-        uint64_t bpz = zns_dev_ex->blocks_per_zone;
-        uint64_t lsb = zns_dev->lba_size_bytes;
-        char buffer[lsb * bpz] = {0};
-        uint32_t ptr = 0;
+        uint64_t lba;
+        char *buffer;
+        uint64_t size;
+    };
 
-        *(uint32_t *)(buffer + (ptr += sizeof(uint32_t))) = info->log_zone_start;
-        *(uint32_t *)(buffer + (ptr += sizeof(uint32_t))) = info->log_zone_end;
-        *(uint32_t *)(buffer + (ptr += sizeof(uint32_t))) = info->data_zone_start;
-        *(uint32_t *)(buffer + (ptr += sizeof(uint32_t))) = info->data_zone_end;
-
-        ptr += sizeof(uint32_t);
+    int collect_extent(uint64_t slba, void *buffer, uint64_t size, void *arg)
+    {
+        std::vector<struct read_segment> *segments = (std::vector<struct read_segment> *)arg;
+        segments->push_back({slba, (char *)buffer, size});
+        return 0;
+    }
 
-        for (uint64_t i = info->log_zone_num_config; i < zns_dev->tparams.zns_num_zones - 1; i++, ptr += sizeof(uint8_t))
+    int zns_udevice_readv(struct user_zns_device *my_dev, const struct zns_iovec *iov, int iovcnt)
+    {
+        uint64_t lbs = my_dev->lba_size_bytes, mdts = zns_dev_ex->mdts;
+        std::vector<struct read_segment> segments;
+        for (int i = 0; i < iovcnt; i++)
         {
-            *(uint8_t *)(buffer + ptr) = info->zone_states[i];
+            if (iov[i].size % lbs)
+            {
+                printf("INVALID: read size not aligned to block size\n");
+                return -1;
+            }
         }
 
-        uint32_t log_mapping_size = log_mapping.size();
-        *(uint32_t *)(buffer + ptr) = log_mapping_size;
-
-        uint32_t data_mapping_size = data_mapping.size();
-        *(uint32_t *)(buffer + (ptr += sizeof(uint32_t))) = data_mapping_size;
-        ptr += sizeof(uint32_t);
-
-        for (auto iter = log_mapping.begin(); iter != log_mapping.end(); iter++, ptr += sizeof(int64_t))
+        // only zns_udevice_read looks into the write buffer, the other reads see the buffered writes once drained
+        int ret = wbuf.capacity ? write_buffer_drain() : 0;
+        if (ret)
+            return ret;
+        uint64_t start = ss_lat_now();
+        uint32_t ticket = gc_read_enter();
+        for (int i = 0; i < iovcnt; i++)
         {
-            *(uint64_t *)(buffer + ptr) = iter->first;
-            *(uint64_t *)(buffer + (ptr += sizeof(int64_t))) = iter->second;
+            stats_add(&ftl_stats.host_bytes_read, iov[i].size);
+            walk_extents(iov[i].address, iov[i].buffer, iov[i].size / lbs, collect_extent, &segments);
         }
 
-        for (auto iter = data_mapping.begin(); iter != data_mapping.end(); iter++, ptr += sizeof(int64_t))
+        // merge extents that continue each other on the device into one command, if the user buffers are not
+        // contiguous as well the merged run is read through a bounce buffer of at most one MDTS and scattered
+        char *bounce = NULL;
+        for (size_t i = 0, j; i < segments.size() && !ret; i = j)
         {
-            *(uint64_t *)(buffer + ptr) = iter->first;
-            *(uint64_t *)(buffer + (ptr += sizeof(int64_t))) = iter->second;
-        }
-
-        *(uint32_t *)(buffer) = ptr;
-
-        metadata_write(info, buffer, roundup(ptr, lsb));
+            struct read_segment *first = &segments[i];
+            j = i + 1;
+            if (first->lba == (uint64_t)ENTRY_INVALID)
+            {
+                memset(first->buffer, 0, first->size);
+                continue;
+            }
 
-        return 0;
-    }
+            uint64_t total = first->size;
+            bool direct = true;
+            for (; j < segments.size(); j++)
+            {
+                struct read_segment *prev = &segments[j - 1], *next = &segments[j];
+                if (next->lba != prev->lba + prev->size / lbs)
+                    break;
+                bool adjacent = next->buffer == prev->buffer + prev->size;
+                if (!(direct && adjacent) && total + next->size > mdts)
+                    break;
+                direct = direct && adjacent;
+                total += next->size;
+            }
 
-    int get_free_lz_num(int offset)
-    {
-        return zns_dev_ex->log_zone_num_config - (zns_dev_ex->log_zone_end - zns_dev_ex->log_zone_start + offset) / zns_dev_ex->blocks_per_zone;
-    }
+            if (direct)
+            {
+                ret = read_extent(first->lba, first->buffer, total, NULL);
+                continue;
+            }
 
-    // find the next empty zone address
-    int find_next_empty_zone()
-    {
-        for (uint64_t i = zns_dev_ex->log_zone_num_config; i < zns_dev->tparams.zns_num_zones - 1; i++)
-        {
-            if (zns_dev_ex->zone_states[i] == EMPTY)
+            if (!bounce)
+                bounce = (char *)malloc(mdts);
+            ret = read_extent(first->lba, bounce, total, NULL);
+            for (size_t k = i, off = 0; !ret && k < j; off += segments[k].size, k++)
             {
-                return i * zns_dev_ex->blocks_per_zone;
+                memcpy(segments[k].buffer, bounce + off, segments[k].size);
             }
         }
-        return -1;
+
+        gc_read_exit(ticket);
+        free(bounce);
+        ss_lat_record(ZNS_LAT_READ, start);
+        return ret;
     }
 
-    int do_merge(std::unordered_map<int64_t, std::unordered_map<int64_t, int64_t> *> *zone_sets_ptr)
+    // packs the `blocks` blocks of the elements into as few log appends as the MDTS allows
+    int log_writev(struct zns_device_extra_info *info, const struct zns_iovec *iov, uint64_t blocks)
     {
-        auto zone_set = *zone_sets_ptr;
-
-        __u64 res_lba;
-        int64_t ret, nlb = zns_dev_ex->blocks_per_zone, lsb = zns_dev->lba_size_bytes;
-        char buffer[nlb * lsb] = {0};
-        char log_buffer[lsb] = {0};
-
-        auto iter = zone_set.begin();
-        for (iter; iter != zone_set.end(); iter++)
+        int ret = 0, cur = 0;
+        uint64_t lbs = zns_dev->lba_size_bytes, pos = 0, summary = info->log_summaries ? 1 : 0;
+        char *staging = staging_buffer_get();
+        std::vector<std::pair<uint64_t, uint32_t>> pieces;
+        while (blocks)
         {
-            int64_t zone_no = find_next_empty_zone(), old_zone = -1;
-            bool used_log = false;
-            if (zone_no == -1)
+            uint32_t granted;
+            uint64_t seq;
+            while (pos == iov[cur].size)
             {
-                zone_no = (zns_dev_ex->log_zone_num_config - 1) * zns_dev_ex->blocks_per_zone; // use the last zone of log zones
-                used_log = true;
+                cur++;
+                pos = 0;
             }
+            uint64_t zslba = log_append_begin(info, iov[cur].address + pos, blocks, &granted, &seq), left = granted * lbs, copied = summary * lbs;
+            char *data = staging;
+            pieces.clear();
 
-            if (data_mapping.find(iter->first) != data_mapping.end())
+            // gather the next granted blocks of the vector, straight from the user buffer if one element holds them all
+            while (left)
             {
-                ret = ss_nvme_device_io_with_mdts(data_mapping[iter->first], buffer, nlb * lsb, true);
-                if (ret)
+                while (pos == iov[cur].size)
                 {
-                    printf("ERROR: failed to read zone at 0x%lx, ret: %ld, during full merge\n", data_mapping[iter->first], ret);
-                    return ret;
+                    cur++;
+                    pos = 0;
                 }
-                zns_dev_ex->zone_states[data_mapping[iter->first] / nlb] = EMPTY;
-                old_zone = data_mapping[iter->first];
+                uint64_t n = iov[cur].size - pos < left ? iov[cur].size - pos : left;
+                if (n == granted * lbs && !summary)
+                    data = (char *)iov[cur].buffer + pos;
+                else
+                    memcpy(staging + copied, (char *)iov[cur].buffer + pos, n);
+                pieces.push_back(std::make_pair(iov[cur].address + pos, n / lbs));
+                pos += n;
+                copied += n;
+                left -= n;
             }
 
-            auto map = *(iter->second);
-            auto ii = map.begin();
-            for (ii; ii != map.end(); ii++)
+            // the pieces get one summary block, its entries are filled in piece by piece
+            if (summary)
             {
-                ret = nvme_read(zns_dev_ex->fd, zns_dev_ex->nsid, ii->second, 0, 0, 0, 0, 0, 0, lsb, buffer + lsb * ii->first, 0, NULL);
-                if (ret)
+                uint32_t *entries = (uint32_t *)((struct log_summary *)staging + 1);
+                log_summary_fill(staging, seq, 0, granted);
+                for (auto iter = pieces.begin(); iter != pieces.end(); entries += iter->second, iter++)
                 {
-                    printf("ERROR: failed to read log block at 0x%lx, ret: %ld\n", ii->second, ret);
-                    return ret;
+                    for (uint32_t i = 0; i < iter->second; i++)
+                        entries[i] = iter->first / lbs + i;
                 }
+                struct log_summary *sum = (struct log_summary *)staging;
+                sum->crc = 0;
+                sum->crc = ss_meta_crc(0, staging, sizeof(*sum) + granted * sizeof(uint32_t));
             }
 
-            if (used_log)
+            __u64 res_lba;
+            uint32_t zone = zslba / info->blocks_per_zone;
+            ret = ss_zone_write_begin(info->zone_mgr, zone);
+            if (!ret)
+                ret = nvme_zns_append(info->fd, info->nsid, zslba, granted + summary - 1, 0, 0, 0, 0,
+                                      (granted + summary) * lbs, data, 0, NULL, &res_lba);
+            ss_zone_write_end(info->zone_mgr, zone, ret ? 0 : granted + summary);
+            pthread_mutex_lock(&map_mutex);
+            // the pieces follow the summary block
+            for (auto iter = pieces.begin(); !ret && iter != pieces.end(); iter++)
             {
-                // means we didn't find a empty zone to write
-                // So write to the last zone of log for backup
-                // Reset the old zone and write to it
-                // Reset the last zone of log
-                nvme_zns_mgmt_send(zns_dev_ex->fd, zns_dev_ex->nsid, old_zone, false, NVME_ZNS_ZSA_RESET, 0, NULL);
-                ret = ss_nvme_device_io_with_mdts(old_zone, buffer, nlb * lsb, false);
-                if (ret)
-                {
-                    printf("ERROR: failed to write zone at 0x%lx, ret: %ld, used log zone\n", zone_no, ret);
-                    return ret;
-                }
-                zns_dev_ex->zone_states[old_zone / nlb] = FULL;
-                // nvme_zns_mgmt_send(zns_dev_ex->fd, zns_dev_ex->nsid, zone_no, false, NVME_ZNS_ZSA_RESET, 0, NULL);
+                log_map_range(iter->first, res_lba + summary, iter->second);
+                res_lba += iter->second;
             }
-            else
+            pthread_mutex_unlock(&map_mutex);
+            log_append_finish(info);
+            if (ret)
             {
-                ret = ss_nvme_device_io_with_mdts(zone_no, buffer, nlb * lsb, false);
-                if (ret)
-                {
-                    printf("ERROR: failed to write zone at 0x%lx, ret: %ld\n", zone_no, ret);
-                    return ret;
-                }
-                data_mapping[iter->first] = zone_no;
-                zns_dev_ex->zone_states[zone_no / nlb] = FULL;
-
-                if (old_zone != -1)
-                    nvme_zns_mgmt_send(zns_dev_ex->fd, zns_dev_ex->nsid, old_zone, false, NVME_ZNS_ZSA_RESET, 0, NULL);
+                printf("ERROR: failed to append at zone 0x%lx, ret: %d \n", zslba, ret);
+                break;
             }
+            stats_add(&ftl_stats.device_bytes_written, (granted + summary) * lbs);
+            blocks -= granted;
+        }
+
+        int err = meta_sync(false);
+        staging_buffer_put(staging);
+        return ret ? ret : err;
+    }
+
+    // Writes the elements of a vector that start or continue a sequential stream into their data zones and packs the
+    // rest into log appends. Once an element went to the log, later ones of the same logical zone follow it there,
+    // its log copy would shadow them otherwise.
+    int data_writev(struct zns_device_extra_info *info, const struct zns_iovec *iov, int iovcnt, uint64_t blocks)
+    {
+        if (!seq_stream_max)
+            return log_writev(info, iov, blocks);
+        uint64_t lbs = zns_dev->lba_size_bytes;
+        std::vector<struct zns_iovec> rest;
+        std::set<uint64_t> logged;
+        int ret = 0;
+        blocks = 0;
+        for (int i = 0; i < iovcnt && !ret; i++)
+        {
+            uint32_t n = iov[i].size / lbs, done = 0;
+            if (!n)
+                continue;
+            uint64_t first = address_2_zone(iov[i].address), last = address_2_zone(iov[i].address + iov[i].size - 1);
+            if (logged.lower_bound(first) == logged.end() || *logged.lower_bound(first) > last)
+                ret = seq_write(info, iov[i].address, (char *)iov[i].buffer, n, &done);
+            if (done == n)
+                continue;
+            rest.push_back({iov[i].address + (uint64_t)done * lbs, (char *)iov[i].buffer + (uint64_t)done * lbs, (n - done) * (uint32_t)lbs});
+            blocks += n - done;
+            for (uint64_t zone = address_2_zone(rest.back().address); zone <= last; zone++)
+                logged.insert(zone);
+        }
+        return ret || !blocks ? ret : log_writev(info, rest.data(), blocks);
+    }
 
-            delete iter->second;
+    int zns_udevice_writev(struct user_zns_device *my_dev, const struct zns_iovec *iov, int iovcnt)
+    {
+        struct zns_device_extra_info *info = (struct zns_device_extra_info *)my_dev->_private;
+        uint64_t lbs = my_dev->lba_size_bytes, blocks = 0;
+        for (int i = 0; i < iovcnt; i++)
+        {
+            if (iov[i].size % lbs)
+            {
+                printf("INVALID: write size not aligned to block size\n");
+                return -1;
+            }
+            blocks += iov[i].size / lbs;
         }
 
-        return 0;
+        uint64_t start = ss_lat_now();
+        stats_add(&ftl_stats.host_bytes_written, blocks * lbs);
+        // buffered writes to the same blocks must not be flushed over these
+        int ret = wbuf.capacity ? write_buffer_drain() : 0;
+        if (!ret)
+            ret = data_writev(info, iov, iovcnt, blocks);
+        ss_lat_record(ZNS_LAT_WRITE, start);
+        return ret;
     }
 
-    void *gc_loop(void *args)
+    void *write_buffer_flush_loop(void *args)
     {
         struct zns_device_extra_info *info = (struct zns_device_extra_info *)args;
+        uint64_t lbs = zns_dev->lba_size_bytes;
+        std::vector<struct zns_iovec> iov;
+        pthread_mutex_lock(&wbuf.mutex);
         while (1)
         {
-            pthread_mutex_lock(&info->gc_mutex);
-            while (!info->gc_thread_stop && !info->do_gc)
+            std::map<uint64_t, uint32_t> *active = &wbuf.blocks[wbuf.active];
+            if (active->empty())
             {
-                pthread_cond_wait(&info->gc_wakeup, &info->gc_mutex);
+                if (wbuf.stop)
+                    break;
+                pthread_cond_wait(&wbuf.wakeup, &wbuf.mutex);
+                continue;
             }
-
-            if (info->gc_thread_stop)
+            // a half that is neither full nor drained waits until its oldest write is flush_ns old
+            uint64_t now = ss_lat_now();
+            if (active->size() < wbuf.capacity && !wbuf.drains && !wbuf.stop && now < wbuf.first_write + wbuf.flush_ns)
             {
-                pthread_mutex_unlock(&info->gc_mutex);
-                break;
+                struct timespec deadline;
+                uint64_t wait = wbuf.first_write + wbuf.flush_ns - now;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += (deadline.tv_nsec + wait) / 1000000000;
+                deadline.tv_nsec = (deadline.tv_nsec + wait) % 1000000000;
+                pthread_cond_timedwait(&wbuf.wakeup, &wbuf.mutex, &deadline);
+                continue;
             }
 
-            std::unordered_map<int64_t, std::unordered_map<int64_t, int64_t> *> zone_sets;
-            std::unordered_map<int64_t, int64_t>::iterator iter;
-            for (iter = log_mapping.begin(); iter != log_mapping.end(); iter++)
-            {
-                int64_t zone_no = address_2_zone(iter->first);
-                if (!map_contains(zone_sets, zone_no))
-                {
-                    zone_sets[zone_no] = new std::unordered_map<int64_t, int64_t>;
-                }
-                auto map = zone_sets[zone_no];
-                map->insert(std::pair<int64_t, int64_t>(address_2_offset(iter->first), iter->second));
-                iter->second &= ENTRY_INVALID;
-            }
+            // the other half was emptied by the previous flush, writers go on in it while this one is written out
+            int half = wbuf.active;
+            wbuf.active = !half;
+            pthread_cond_broadcast(&wbuf.changed);
+            pthread_mutex_unlock(&wbuf.mutex);
 
-            int ret = do_merge(&zone_sets);
-            if (ret)
+            // runs of consecutive blocks that also sit next to each other in the buffer take one element
+            iov.clear();
+            for (auto iter = wbuf.blocks[half].begin(); iter != wbuf.blocks[half].end(); iter++)
             {
-                printf("Error: GC failed, ret:%d\n", ret);
+                char *data = wbuf.data[half] + (uint64_t)iter->second * lbs;
+                struct zns_iovec *last = iov.empty() ? NULL : &iov.back();
+                if (last && last->address + last->size == iter->first * lbs && (char *)last->buffer + last->size == data)
+                    last->size += lbs;
+                else
+                    iov.push_back({iter->first * lbs, data, (uint32_t)lbs});
             }
+            int ret = data_writev(info, iov.data(), iov.size(), wbuf.blocks[half].size());
 
-            for (int i = 0; i < info->log_zone_num_config; i++)
+            pthread_mutex_lock(&wbuf.mutex);
+            if (ret)
             {
-                nvme_zns_mgmt_send(info->fd, info->nsid, i * info->blocks_per_zone, false, NVME_ZNS_ZSA_RESET, 0, NULL);
+                printf("ERROR: failed to flush %lu buffered blocks, ret: %d\n", wbuf.blocks[half].size(), ret);
+                wbuf.status = ret;
             }
-            info->log_zone_end = info->log_zone_start;
-            log_mapping.clear();
-
-            info->do_gc = false;
-            pthread_cond_signal(&info->gc_sleep);
-            pthread_mutex_unlock(&info->gc_mutex);
+            stats_add(&ftl_stats.write_buffer_flushes, 1);
+            wbuf.blocks[half].clear();
+            pthread_cond_broadcast(&wbuf.changed);
         }
-
+        pthread_mutex_unlock(&wbuf.mutex);
         return (void *)0;
     }
 
-    int init_ss_zns_device(struct zdev_init_params *params, struct user_zns_device **my_dev)
+    int zns_udevice_flush(struct user_zns_device *my_dev)
     {
-        int fd = nvme_open(params->name);
-        if (fd < 0)
+        // the write buffer is per process, not per device
+        (void)my_dev;
+        return wbuf.capacity ? write_buffer_drain() : 0;
+    }
+
+    struct zns_async_io
+    {
+        zns_io_callback cb;
+        void *ctx;
+        uint32_t pending;
+        int status;
+        bool reader; // holds a gc_read_enter until completion
+        uint32_t read_ticket;
+        uint64_t start;
+    };
+
+    struct zns_async_append
+    {
+        struct zns_async_io *io;
+        uint64_t address;
+        uint64_t zslba;
+        char *buffer;
+        char *staging; // summary block and a copy of the data when the log has summaries
+        uint32_t blocks;
+    };
+
+    // drop one reference of an async request, the last one reports the first error (if any) to the user
+    void async_io_put(struct zns_async_io *io, int status)
+    {
+        int ok = 0;
+        if (status)
+            __atomic_compare_exchange_n(&io->status, &ok, status, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+        if (__atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL) == 0)
         {
-            printf("device %s opening failed %d errno %d \n", params->name, fd, errno);
-            return -fd;
+            if (io->reader)
+                gc_read_exit(io->read_ticket);
+            ss_lat_record(io->reader ? ZNS_LAT_READ : ZNS_LAT_WRITE, io->start);
+            io->cb(io->ctx, __atomic_load_n(&io->status, __ATOMIC_ACQUIRE));
+            free(io);
         }
+    }
 
-        struct zns_device_extra_info *info = static_cast<struct zns_device_extra_info *>(calloc(sizeof(struct zns_device_extra_info), 1));
-        (*my_dev) = static_cast<struct user_zns_device *>(calloc(sizeof(struct user_zns_device), 1));
-        info->fd = fd;
-        info->gc_watermark = params->gc_wmark;
-        info->log_zone_num_config = params->log_zones;
-        (*my_dev)->_private = info;
+    struct zns_async_io *async_io_get(zns_io_callback cb, void *ctx)
+    {
+        struct zns_async_io *io = (struct zns_async_io *)calloc(1, sizeof(struct zns_async_io));
+        if (!io)
+            return NULL;
+        io->cb = cb;
+        io->ctx = ctx;
+        io->start = ss_lat_now();
+        // the submitter holds one reference until everything is queued
+        io->pending = 1;
+        return io;
+    }
 
-        int ret = nvme_get_nsid(fd, &(info->nsid));
-        if (ret != 0)
-        {
-            printf("ERROR: failed to retrieve the nsid %d \n", ret);
-            return ret;
-        }
+    void async_read_done(void *ctx, int status, uint64_t)
+    {
+        async_io_put((struct zns_async_io *)ctx, status);
+    }
 
-        struct nvme_id_ns ns;
-        ret = nvme_identify_ns(fd, info->nsid, &ns);
-        if (ret)
+    int async_read_extent(uint64_t slba, void *buffer, uint64_t size, void *arg)
+    {
+        struct zns_async_io *io = (struct zns_async_io *)arg;
+        if (slba == (uint64_t)ENTRY_INVALID)
         {
-            printf("ERROR: failed to retrieve the nsid struct %d \n", ret);
-            return ret;
+            memset(buffer, 0, size);
+            return 0;
         }
 
-        if (params->force_reset)
+        uint64_t lba_s = zns_dev->lba_size_bytes;
+        for (uint64_t off = 0; off < size; off += zns_dev_ex->mdts)
         {
-            ret = nvme_zns_mgmt_send(fd, info->nsid, 0, true, NVME_ZNS_ZSA_RESET, 0, NULL);
+            uint64_t io_num = size - off < zns_dev_ex->mdts ? size - off : zns_dev_ex->mdts;
+            __atomic_add_fetch(&io->pending, 1, __ATOMIC_ACQ_REL);
+            int ret = ss_io_engine_submit(zns_dev_ex->io_engine, SS_IO_READ, slba + off / lba_s, (char *)buffer + off, io_num, async_read_done, io);
             if (ret)
             {
-                printf("ERROR: failed to reset all zones %d \n", ret);
+                __atomic_sub_fetch(&io->pending, 1, __ATOMIC_ACQ_REL);
+                printf("ERROR: failed to submit read at 0x%lx, ret: %d\n", slba + off / lba_s, ret);
                 return ret;
             }
-
-            // info->data_zone_start = info->data_zone_end = params->log_zones * blocks_per_zone;
-            info->log_zone_start = info->log_zone_end = 0;
+            stats_add(&ftl_stats.device_bytes_read, io_num);
         }
+        return 0;
+    }
 
-        (*my_dev)->lba_size_bytes = 1 << ns.lbaf[(ns.flbas & 0xf)].ds;
-        (*my_dev)->tparams.zns_lba_size = (*my_dev)->lba_size_bytes;
-        // info->mdts = get_mdts_size(info->fd, params->name);
-        info->mdts = MDTS;
-
-        struct nvme_zone_report report;
-        ret = nvme_zns_mgmt_recv(fd, info->nsid, 0,
-                                 NVME_ZNS_ZRA_REPORT_ZONES, NVME_ZNS_ZRAS_REPORT_ALL,
-                                 0, sizeof(report), (void *)&report);
-        if (ret != 0)
+    int zns_udevice_read_async(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size, zns_io_callback cb, void *ctx)
+    {
+        if (size % my_dev->lba_size_bytes)
         {
-            fprintf(stderr, "failed to report zones, ret %d \n", ret);
-            return ret;
+            printf("INVALID: read size not aligned to block size\n");
+            return -1;
         }
 
-        (*my_dev)->tparams.zns_num_zones = report.nr_zones;
-        info->zone_states = (uint8_t *)calloc(report.nr_zones, sizeof(uint8_t));
-
-        uint64_t total_size = sizeof(report) + (report.nr_zones * sizeof(struct nvme_zns_desc));
-        char *zone_reports = (char *)calloc(1, total_size);
-        // dont need to report all for milestone 2, but needed for milestone 5
-        ret = nvme_zns_mgmt_recv(fd, info->nsid, 0,
-                                 NVME_ZNS_ZRA_REPORT_ZONES, NVME_ZNS_ZRAS_REPORT_ALL,
-                                 1, total_size, (void *)zone_reports);
+        int ret = wbuf.capacity ? write_buffer_drain() : 0;
         if (ret)
-        {
-            free(zone_reports);
-            printf("ERROR: failed to get zone reports %d \n", ret);
             return ret;
-        }
-
-        uint64_t blocks_per_zone = ((struct nvme_zone_report *)zone_reports)->entries[0].zcap;
-        info->blocks_per_zone = blocks_per_zone;
-        (*my_dev)->tparams.zns_zone_capacity = blocks_per_zone * (*my_dev)->lba_size_bytes;
-        // need to update this when doing persistence
-        (*my_dev)->capacity_bytes = (report.nr_zones - params->log_zones - 1) * ((*my_dev)->tparams.zns_zone_capacity);
-
-        for (uint64_t i = params->log_zones; i < report.nr_zones; i++)
-        {
-            info->zone_states[i] = (((struct nvme_zone_report *)zone_reports)->entries[i].zs >> 4);
-        }
-
-        free(zone_reports);
-
-        // populate log_mapping for ms5
-        // populate data_mapping for ms5
-
-        // record log_zone_start and log_zone_end for ms5
-        // record data_zone_start and data_zone_end for ms5
+        struct zns_async_io *io = async_io_get(cb, ctx);
+        if (!io)
+            return -ENOMEM;
+
+        io->reader = true;
+        stats_add(&ftl_stats.host_bytes_read, size);
+        io->read_ticket = gc_read_enter();
+        ret = walk_extents(address, buffer, size / my_dev->lba_size_bytes, async_read_extent, io);
+        async_io_put(io, ret);
+        return 0;
+    }
 
-        ret = pthread_create(&info->gc_thread_id, NULL, &gc_loop, info);
-        if (ret)
+    void async_append_done(void *ctx, int status, uint64_t result)
+    {
+        struct zns_async_append *append = (struct zns_async_append *)ctx;
+        ss_zone_write_end(zns_dev_ex->zone_mgr, append->zslba / zns_dev_ex->blocks_per_zone,
+                          status ? 0 : append->blocks + (append->staging ? 1 : 0));
+        if (status)
+            printf("ERROR: failed to append at zone 0x%lx, ret: %d \n", append->zslba, status);
+        else
         {
-            printf("ERROR: failed to create gc thread %d \n", ret);
-            return ret;
+            stats_add(&ftl_stats.device_bytes_written, (uint64_t)(append->blocks + (append->staging ? 1 : 0)) * zns_dev->lba_size_bytes);
+            pthread_mutex_lock(&map_mutex);
+            log_map_range(append->address, result + (append->staging ? 1 : 0), append->blocks);
+            pthread_mutex_unlock(&map_mutex);
         }
+        log_append_finish(zns_dev_ex);
+        if (!status)
+            status = meta_sync(false);
 
-        zns_dev = *my_dev;
-        zns_dev_ex = info;
-
-        // read log_mapping data_mapping zns_device_extra_info
-        // if log zone number < 512, one zone reserve for metadata_zone is enough
-        ret = init_descriptor(info);
-
-        return 0;
+        async_io_put(append->io, status);
+        free(append->staging);
+        free(append);
     }
 
-    int zns_udevice_read(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size)
+    int zns_udevice_write_async(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size, zns_io_callback cb, void *ctx)
     {
         if (size % my_dev->lba_size_bytes)
         {
-            printf("INVALID: read size not aligned to block size\n");
+            printf("INVALID: write size not aligned to block size\n");
             return -1;
         }
 
-        int32_t ret, lba_s = my_dev->lba_size_bytes;
-        uint32_t blocks = size / lba_s, num_read = 0;
         struct zns_device_extra_info *info = (struct zns_device_extra_info *)my_dev->_private;
-        for (uint64_t i = address; i < address + blocks * lba_s; i += lba_s)
+        uint32_t blocks = size / my_dev->lba_size_bytes, done = 0;
+        int ret = wbuf.capacity ? write_buffer_drain() : 0;
+        if (ret)
+            return ret;
+        struct zns_async_io *io = async_io_get(cb, ctx);
+        if (!io)
+            return -ENOMEM;
+        stats_add(&ftl_stats.host_bytes_written, size);
+
+        // reserve one append at a time, so completions can publish and the gc can run while later pieces wait for
+        // log space
+        while (done < blocks)
         {
-            uint64_t entry;
-            bool read_data = true;
-            // the top bit 1 means invalid
-            if (map_contains(log_mapping, i))
-            {
-                entry = log_mapping[i];
-                read_data = (entry & ENTRY_INVALID);
-            }
-
-            if (read_data)
+            struct zns_async_append *append = (struct zns_async_append *)calloc(1, sizeof(struct zns_async_append));
+            append->io = io;
+            append->address = address + (uint64_t)done * my_dev->lba_size_bytes;
+            append->buffer = (char *)buffer + (uint64_t)done * my_dev->lba_size_bytes;
+            uint64_t seq, lbs = my_dev->lba_size_bytes;
+            append->zslba = log_append_begin(info, append->address, blocks - done, &append->blocks, &seq);
+            __atomic_add_fetch(&io->pending, 1, __ATOMIC_ACQ_REL);
+            done += append->blocks;
+
+            char *data = append->buffer;
+            uint64_t bytes = append->blocks * lbs;
+            if (info->log_summaries)
             {
-                uint64_t zone_no = address_2_zone(i);
-                if (!map_contains(data_mapping, zone_no))
-                {
-                    // nothing at this address
-                    memset(buffer + num_read, 0, lba_s);
-                    num_read += lba_s;
-                    continue;
-                }
-
-                entry = data_mapping[zone_no] + address_2_offset(i);
+                append->staging = (char *)malloc(bytes + lbs);
+                log_summary_fill(append->staging, seq, append->address, append->blocks);
+                memcpy(append->staging + lbs, append->buffer, bytes);
+                data = append->staging;
+                bytes += lbs;
             }
-
-            ret = nvme_read(info->fd, info->nsid, (entry & ~ENTRY_INVALID), 0, 0, 0, 0, 0, 0, lba_s, (char *)buffer + num_read, 0, NULL);
+            ret = ss_zone_write_begin(info->zone_mgr, append->zslba / info->blocks_per_zone);
+            if (!ret)
+                ret = ss_io_engine_submit(info->io_engine, SS_IO_APPEND, append->zslba, data, bytes, async_append_done, append);
             if (ret)
-            {
-                printf("ERROR: failed to read at 0x%lx, ret: %d\n", (entry & ~ENTRY_INVALID), ret);
-                return ret;
-            }
-            num_read += lba_s;
+                async_append_done(append, ret, 0);
         }
 
+        async_io_put(io, 0);
         return 0;
     }
 
-    int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size)
+    int zns_udevice_get_stats(struct user_zns_device *my_dev, struct zns_udevice_stats *stats)
     {
-        if (size % my_dev->lba_size_bytes)
-        {
-            printf("INVALID: write size not aligned to block size\n");
-            return -1;
-        }
-
         struct zns_device_extra_info *info = (struct zns_device_extra_info *)my_dev->_private;
-        uint32_t blocks = size / my_dev->lba_size_bytes;
-        pthread_mutex_lock(&zns_dev_ex->gc_mutex);
-        while (get_free_lz_num(blocks) <= info->gc_watermark)
-        {
-            zns_dev_ex->do_gc = true;
-            pthread_cond_signal(&zns_dev_ex->gc_wakeup);
-            pthread_cond_wait(&zns_dev_ex->gc_sleep, &zns_dev_ex->gc_mutex);
-        }
+        uint64_t meta_written, meta_read, meta_resets;
+        pthread_mutex_lock(&info->gc_mutex);
+        *stats = ftl_stats;
+        // writers journal without gc_mutex
+        pthread_mutex_lock(&meta_write_mutex);
+        ss_meta_log_io(info->meta_log, &meta_written, &meta_read, &meta_resets);
+        pthread_mutex_unlock(&meta_write_mutex);
+        stats->device_bytes_written += meta_written;
+        stats->device_bytes_read += meta_read;
+        stats->zone_resets += meta_resets;
+        if (read_cache)
+            ss_cache_counters(read_cache, &stats->cache_hits, &stats->cache_misses);
+        ss_zone_mgr_counters(info->zone_mgr, &stats->zone_closes, &stats->zone_finishes);
+        stats->free_zones = zone_pool.size();
+        stats->dirty_zones = zone_dirty.size() + zones_resetting;
+        stats->log_zones = log_slot_num;
+        stats->free_log_zones = log_free_num;
+        stats->data_zones = 0;
+        for (uint64_t i = 0; i < logical_zone_num; i++)
+            stats->data_zones += data_mapping[i] != MAP_INVALID;
+        pthread_mutex_unlock(&info->gc_mutex);
+        return 0;
+    }
 
-        __u64 res_lba;
-        int32_t ret, lz_end_before = info->log_zone_end, z_no = info->log_zone_end / info->blocks_per_zone;
-        ret = nvme_zns_append(info->fd, info->nsid, z_no * info->blocks_per_zone, blocks - 1, 0, 0, 0, 0, size, buffer, 0, NULL, &res_lba);
-        if (ret)
-        {
-            printf("ERROR: failed to write at 0x%d, ret: %d \n", info->log_zone_end, ret);
-            return ret;
-        }
+    static_assert(ZNS_LAT_OPS <= SS_LAT_OPS_MAX, "every latency op needs a histogram");
 
-        info->log_zone_end = res_lba + 1;
-        for (uint32_t i = 0; i < blocks; i++)
+    int zns_udevice_get_latency(struct user_zns_device *my_dev, struct zns_latency_stats *stats, bool reset)
+    {
+        // the histograms are per process, not per device
+        (void)my_dev;
+        struct ss_lat_histogram *hist = (struct ss_lat_histogram *)malloc(sizeof(struct ss_lat_histogram));
+        if (!hist)
+            return -ENOMEM;
+        for (uint32_t op = 0; op < ZNS_LAT_OPS; op++)
         {
-            log_mapping[address + i * my_dev->lba_size_bytes] = lz_end_before + i;
+            ss_lat_snapshot(op, hist);
+            stats[op].count = hist->count;
+            stats[op].p50_ns = ss_lat_percentile(hist, 0.5);
+            stats[op].p99_ns = ss_lat_percentile(hist, 0.99);
+            stats[op].p999_ns = ss_lat_percentile(hist, 0.999);
+            stats[op].max_ns = hist->max;
         }
-
-        pthread_mutex_unlock(&zns_dev_ex->gc_mutex);
+        if (reset)
+            ss_lat_reset();
+        free(hist);
         return 0;
     }
 
     int deinit_ss_zns_device(struct user_zns_device *my_dev)
     {
         struct zns_device_extra_info *info = (struct zns_device_extra_info *)my_dev->_private;
+        // the flusher writes out what is left before it stops
+        if (wbuf.capacity)
+        {
+            pthread_mutex_lock(&wbuf.mutex);
+            wbuf.stop = true;
+            pthread_cond_signal(&wbuf.wakeup);
+            pthread_mutex_unlock(&wbuf.mutex);
+            pthread_join(wbuf.flusher, NULL);
+            if (wbuf.status)
+                printf("ERROR: buffered writes were lost, ret: %d\n", wbuf.status);
+            free(wbuf.data[0]);
+            free(wbuf.data[1]);
+            wbuf.capacity = 0;
+        }
+        pthread_mutex_lock(&info->gc_mutex);
         info->gc_thread_stop = true;
+        pthread_mutex_unlock(&info->gc_mutex);
         pthread_cond_signal(&info->gc_wakeup);
 
-        // wait for gc stop
+        // wait for gc stop, a merge in progress still writes through the I/O engine
         pthread_join(info->gc_thread_id, NULL);
+        merge_workers_join(info);
+        pthread_mutex_lock(&info->gc_mutex);
+        zone_resetter_stop = true;
+        pthread_mutex_unlock(&info->gc_mutex);
+        pthread_cond_signal(&zone_dirty_wakeup);
+        pthread_join(zone_resetter_id, NULL);
+
+        // then drain the async requests, their completions still publish into the mapping
+        ss_io_engine_destroy(info->io_engine);
+        ss_zone_mgr_destroy(info->zone_mgr);
+
+        // mapping changes are journaled as they are made, the reset counts of the last resets may still be pending
+        pthread_mutex_lock(&info->gc_mutex);
+        int ret = meta_commit();
+        pthread_mutex_unlock(&info->gc_mutex);
+        if (ret)
+            printf("ERROR: failed to journal the last zone reset counts, ret: %d\n", ret);
 
         pthread_mutex_destroy(&info->gc_mutex);
         pthread_cond_destroy(&info->gc_wakeup);
 
-        int ret = restore_descriptor(info);
-
+        ss_meta_log_destroy(info->meta_log);
+        ss_lat_destroy();
+        if (read_cache)
+            ss_cache_destroy(read_cache);
+        read_cache = NULL;
+        mapping_free();
+        merge_pool_free();
+        staging_pool_free();
         free(info->zone_states);
         free(my_dev->_private);
         free(my_dev);
-        return 0;
+        return ret;
     }
 }
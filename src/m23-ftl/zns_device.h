@@ -52,6 +52,10 @@ struct user_zns_device {
     void *_private;
 };
 
+struct ss_io_engine;
+struct ss_meta_log;
+struct ss_zone_mgr;
+
 struct zns_device_extra_info
 {
     int fd;
@@ -62,8 +66,16 @@ struct zns_device_extra_info
     uint32_t data_zone_start; // for milestone 5
     uint32_t data_zone_end;   // for milestone 5
     uint8_t *zone_states;
+    uint32_t meta_zone_start; // first zone of the metadata region, it runs up to the last zone
     uint32_t mdts;
-    int gc_watermark;
+    bool simple_copy;            // controller supports NVMe Simple Copy, the gc moves data without the host
+    uint32_t copy_max_ranges;    // source ranges per copy command (MSRC + 1)
+    uint32_t copy_max_range_len; // blocks per source range (MSSRL)
+    uint32_t copy_max_len;       // blocks per copy command (MCL)
+    uint32_t max_open_zones;     // MOR + 1 of the ZNS identify data, UINT32_MAX without a limit
+    uint32_t max_active_zones;   // MAR + 1
+    int gc_watermark;      // writers block for the gc at or below this many free log zones
+    int gc_soft_watermark; // the gc starts reclaiming in the background at or below this many free log zones
     int log_zone_num_config;
 
     pthread_mutex_t gc_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -73,6 +85,15 @@ struct zns_device_extra_info
     pthread_t gc_thread_id = 0;
     bool gc_thread_stop = false;
     bool do_gc = false;
+
+    uint32_t gc_waiters; // writers blocked on the hard watermark
+
+    struct ss_io_engine *io_engine;
+    struct ss_meta_log *meta_log;
+    struct ss_zone_mgr *zone_mgr; // explicit opens, closes and finishes within the open and active zone limits
+    uint32_t inflight_appends; // appends that reserved log space but are not mapped yet, gc waits for them
+    bool log_summaries; // log appends carry a summary block instead of being journaled
+    uint32_t wear_level_threshold; // reset gap that makes idle time move cold data onto worn zones, 0 disables
     // ...
 };
 
@@ -80,13 +101,99 @@ struct zdev_init_params{
     char *name;
     int log_zones;
     int gc_wmark;
+    int gc_soft_wmark; // background gc threshold, raised to gc_wmark + 1 if not above it
     bool force_reset;
+    int io_depth; // queue depth of the asynchronous I/O engine
+    int merge_workers; // threads merging the logical zones of a gc round in parallel
+    int meta_zones; // zones at the end of the device for mapping checkpoints and the journal, 2 if not set
+    bool log_summaries; // prefix log appends with a summary block and rebuild the log by a zone scan on mount, rules out switch merges
+    int wear_level_threshold; // resets a free zone may be ahead of the least worn cold data zone before idle time swaps them, 0 disables
+    bool hot_cold_streams; // separate log zones for the writes to often overwritten logical zones
+    int log_lanes; // open log zones per stream, logical zones are spread over them so their appends run in parallel, 1 if not set
+    uint64_t read_cache_bytes; // DRAM cache for blocks read through zns_udevice_read, 0 disables
+    uint64_t write_buffer_bytes; // DRAM write-back buffer for small zns_udevice_write calls, 0 writes through
+    int write_buffer_flush_us; // age of the oldest buffered write at which the buffer is flushed
+    int seq_streams; // sequential writers that write straight into data zones at once, 0 sends every write to the log
+};
+
+// one element of a vectored request, address and size must be LBA aligned
+struct zns_iovec {
+    uint64_t address;
+    void *buffer;
+    uint32_t size;
+};
+
+// Counters since init_ss_zns_device, the write amplification is device_bytes_written / host_bytes_written. Device
+// bytes cover log appends with their summary blocks, merge and wear leveling copies and the metadata region.
+struct zns_udevice_stats {
+    uint64_t host_bytes_written;
+    uint64_t host_bytes_read;
+    uint64_t device_bytes_written;
+    uint64_t device_bytes_read;  // user reads, host side merge copies, mount scans and metadata reads
+    uint64_t copy_bytes_written; // part of device_bytes_written that Simple Copy moved inside the device
+    uint64_t switch_merges;
+    uint64_t partial_merges;
+    uint64_t full_merges;
+    uint64_t wear_level_moves;
+    uint64_t gc_invocations;   // log zones the gc set out to reclaim
+    uint64_t gc_pause_ns;      // time the gc waited for earlier reads to finish before resetting or freeing
+    uint64_t gc_pause_max_ns;
+    uint64_t zone_resets;      // of data, log and metadata zones
+    uint64_t zone_closes;      // open zones closed to make room under the open zone limit
+    uint64_t zone_finishes;    // partly written zones finished to make room under the active zone limit
+    uint64_t writer_block_ns;  // time writers waited on gc_sleep at the hard watermark
+    uint64_t cache_hits;       // blocks zns_udevice_read found in the read cache
+    uint64_t cache_misses;
+    uint64_t write_buffer_flushes;
+    uint64_t write_buffer_absorbed; // buffered blocks overwritten before they were flushed
+    uint64_t seq_bytes_written;     // host bytes sequential streams wrote straight into data zones
+    // current zone counts
+    uint32_t free_zones;       // reset and ready for merges
+    uint32_t dirty_zones;      // waiting for the resetter
+    uint32_t log_zones;
+    uint32_t free_log_zones;
+    uint32_t data_zones;       // logical zones with a data zone
+};
+
+// operations with a latency histogram, merges are timed per gc round and metadata per persisted mapping change
+enum zns_latency_op {
+    ZNS_LAT_READ,
+    ZNS_LAT_WRITE,
+    ZNS_LAT_MERGE,
+    ZNS_LAT_RESET,
+    ZNS_LAT_META,
+    ZNS_LAT_OPS,
 };
 
+// latencies in nanoseconds, the percentiles are within 1/16 of the recorded values
+struct zns_latency_stats {
+    uint64_t count;
+    uint64_t p50_ns;
+    uint64_t p99_ns;
+    uint64_t p999_ns;
+    uint64_t max_ns;
+};
+
+// status is 0 on success, otherwise the first failing NVMe status or negative errno of the request
+typedef void (*zns_io_callback)(void *ctx, int status);
+
 int init_ss_zns_device(struct zdev_init_params *params, struct user_zns_device **my_dev);
 int zns_udevice_read(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size);
 int zns_udevice_write(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size);
+// With a write buffer zns_udevice_write returns once the data is buffered, it is durable after the next flush. Flush
+// errors are returned by the next write or flush.
+int zns_udevice_flush(struct user_zns_device *my_dev);
 int deinit_ss_zns_device(struct user_zns_device *my_dev);
+int zns_udevice_get_stats(struct user_zns_device *my_dev, struct zns_udevice_stats *stats);
+// fills stats[ZNS_LAT_OPS] with the latencies since init or the last reset, then starts over if reset is set
+int zns_udevice_get_latency(struct user_zns_device *my_dev, struct zns_latency_stats *stats, bool reset);
+// vectored variants, the FTL builds the largest device commands it can across the elements. For writev, scattered
+// addresses are packed into shared log appends and later elements win where addresses overlap.
+int zns_udevice_readv(struct user_zns_device *my_dev, const struct zns_iovec *iov, int iovcnt);
+int zns_udevice_writev(struct user_zns_device *my_dev, const struct zns_iovec *iov, int iovcnt);
+// asynchronous variants, on a 0 return the callback is invoked exactly once from an I/O thread when the request completes
+int zns_udevice_read_async(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size, zns_io_callback cb, void *ctx);
+int zns_udevice_write_async(struct user_zns_device *my_dev, uint64_t address, void *buffer, uint32_t size, zns_io_callback cb, void *ctx);
 };
 
 #endif //STOSYS_PROJECT_ZNS_DEVICE_H
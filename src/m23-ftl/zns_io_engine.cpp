@@ -0,0 +1,461 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "zns_io_engine.h"
+#include "libnvme.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// NVMe passthrough over io_uring needs 128-byte SQEs / 32-byte CQEs (Linux 5.19+)
+#if defined(IORING_SETUP_SQE128) && defined(__NR_io_uring_setup)
+#define SS_HAVE_URING_CMD 1
+#endif
+
+extern "C"
+{
+    struct ss_io_request
+    {
+        enum ss_io_opcode op;
+        uint64_t slba;
+        void *buffer;
+        uint32_t size;
+        ss_io_callback cb;
+        void *ctx;
+        struct ss_io_request *next;
+    };
+
+#ifdef SS_HAVE_URING_CMD
+    // kernel ABI of struct nvme_uring_cmd, libnvme ships its own passthru structs so linux/nvme_ioctl.h cannot be included
+    struct ss_nvme_uring_cmd
+    {
+        __u8 opcode;
+        __u8 flags;
+        __u16 rsvd1;
+        __u32 nsid;
+        __u32 cdw2;
+        __u32 cdw3;
+        __u64 metadata;
+        __u64 addr;
+        __u32 metadata_len;
+        __u32 data_len;
+        __u32 cdw10;
+        __u32 cdw11;
+        __u32 cdw12;
+        __u32 cdw13;
+        __u32 cdw14;
+        __u32 cdw15;
+        __u32 timeout_ms;
+        __u32 rsvd2;
+    };
+#define SS_NVME_URING_CMD_IO _IOWR('N', 0x80, struct ss_nvme_uring_cmd)
+#define SS_SQE_SIZE 128
+#define SS_CQE_SIZE 32
+
+    struct ss_uring
+    {
+        int ring_fd;
+        int ng_fd;
+        unsigned *sq_tail;
+        unsigned *sq_mask;
+        unsigned *sq_array;
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned *cq_mask;
+        char *sqes;
+        char *cqes;
+        void *sq_ptr;
+        void *cq_ptr;
+        size_t sq_len;
+        size_t cq_len;
+        size_t sqes_len;
+        pthread_t reaper;
+    };
+#endif
+
+    struct ss_io_engine
+    {
+        int fd;
+        uint32_t nsid;
+        uint32_t lba_size;
+        uint32_t qdepth;
+        bool uring;
+        bool stop;
+
+        uint32_t inflight;
+        pthread_mutex_t mutex;
+        pthread_cond_t slot_free;
+        pthread_cond_t work;
+
+        // thread-backed fallback, requests are queued here and picked up by qdepth workers
+        struct ss_io_request *head;
+        struct ss_io_request *tail;
+        pthread_t *threads;
+        uint32_t thread_num;
+#ifdef SS_HAVE_URING_CMD
+        struct ss_uring ring;
+#endif
+    };
+
+    static void io_complete(struct ss_io_engine *engine, struct ss_io_request *req, int status, uint64_t result)
+    {
+        req->cb(req->ctx, status, result);
+        free(req);
+
+        pthread_mutex_lock(&engine->mutex);
+        engine->inflight--;
+        pthread_cond_broadcast(&engine->slot_free);
+        pthread_mutex_unlock(&engine->mutex);
+    }
+
+    static int io_exec_sync(struct ss_io_engine *engine, struct ss_io_request *req, uint64_t *result)
+    {
+        __u64 res_lba = 0;
+        int ret = -EINVAL;
+        uint16_t nlb = req->size / engine->lba_size - 1;
+        switch (req->op)
+        {
+        case SS_IO_READ:
+            ret = nvme_read(engine->fd, engine->nsid, req->slba, nlb, 0, 0, 0, 0, 0, req->size, req->buffer, 0, NULL);
+            break;
+        case SS_IO_WRITE:
+            ret = nvme_write(engine->fd, engine->nsid, req->slba, nlb, 0, 0, 0, 0, 0, 0, req->size, req->buffer, 0, NULL);
+            break;
+        case SS_IO_APPEND:
+            ret = nvme_zns_append(engine->fd, engine->nsid, req->slba, nlb, 0, 0, 0, 0, req->size, req->buffer, 0, NULL, &res_lba);
+            break;
+        }
+        *result = res_lba;
+        return ret;
+    }
+
+    static void *io_worker(void *args)
+    {
+        struct ss_io_engine *engine = (struct ss_io_engine *)args;
+        pthread_mutex_lock(&engine->mutex);
+        while (1)
+        {
+            while (!engine->stop && !engine->head)
+            {
+                pthread_cond_wait(&engine->work, &engine->mutex);
+            }
+            // stop only once the queue is drained
+            if (!engine->head)
+                break;
+
+            struct ss_io_request *req = engine->head;
+            engine->head = req->next;
+            if (!engine->head)
+                engine->tail = NULL;
+            pthread_mutex_unlock(&engine->mutex);
+
+            uint64_t result;
+            int ret = io_exec_sync(engine, req, &result);
+            io_complete(engine, req, ret, result);
+
+            pthread_mutex_lock(&engine->mutex);
+        }
+        pthread_mutex_unlock(&engine->mutex);
+        return (void *)0;
+    }
+
+#ifdef SS_HAVE_URING_CMD
+    static int uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+        return ret < 0 ? -errno : ret;
+    }
+
+    // caller holds engine->mutex, inflight <= qdepth = SQ size so there is always a free SQE
+    static int uring_queue(struct ss_io_engine *engine, struct ss_io_request *req)
+    {
+        struct ss_uring *ring = &engine->ring;
+        unsigned tail = *ring->sq_tail, idx = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = (struct io_uring_sqe *)(ring->sqes + idx * SS_SQE_SIZE);
+        memset(sqe, 0, SS_SQE_SIZE);
+        sqe->user_data = (__u64)(uintptr_t)req;
+
+        if (req)
+        {
+            struct ss_nvme_uring_cmd *cmd = (struct ss_nvme_uring_cmd *)sqe->cmd;
+            sqe->opcode = IORING_OP_URING_CMD;
+            sqe->fd = ring->ng_fd;
+            sqe->cmd_op = SS_NVME_URING_CMD_IO;
+            cmd->opcode = req->op == SS_IO_READ ? nvme_cmd_read : (req->op == SS_IO_WRITE ? nvme_cmd_write : nvme_zns_cmd_append);
+            cmd->nsid = engine->nsid;
+            cmd->addr = (__u64)(uintptr_t)req->buffer;
+            cmd->data_len = req->size;
+            cmd->cdw10 = req->slba & 0xffffffff;
+            cmd->cdw11 = req->slba >> 32;
+            cmd->cdw12 = req->size / engine->lba_size - 1;
+        }
+        else
+        {
+            // a NOP without request wakes up the reaper on shutdown
+            sqe->opcode = IORING_OP_NOP;
+        }
+
+        ring->sq_array[idx] = idx;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        int ret = uring_enter(ring->ring_fd, 1, 0, 0);
+        return ret < 0 ? ret : 0;
+    }
+
+    static void *uring_reaper(void *args)
+    {
+        struct ss_io_engine *engine = (struct ss_io_engine *)args;
+        struct ss_uring *ring = &engine->ring;
+        while (1)
+        {
+            unsigned head = *ring->cq_head, tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+            if (head == tail)
+            {
+                pthread_mutex_lock(&engine->mutex);
+                bool done = engine->stop && !engine->inflight;
+                pthread_mutex_unlock(&engine->mutex);
+                if (done)
+                    break;
+                uring_enter(ring->ring_fd, 0, 1, IORING_ENTER_GETEVENTS);
+                continue;
+            }
+
+            struct io_uring_cqe *cqe = (struct io_uring_cqe *)(ring->cqes + (head & *ring->cq_mask) * SS_CQE_SIZE);
+            struct ss_io_request *req = (struct ss_io_request *)(uintptr_t)cqe->user_data;
+            // res is the NVMe status (or -errno), the first big CQE word is the command result (append LBA)
+            int status = cqe->res;
+            uint64_t result = cqe->big_cqe[0];
+            __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+            if (req)
+                io_complete(engine, req, status, result);
+        }
+        return (void *)0;
+    }
+
+    static void uring_teardown(struct ss_uring *ring)
+    {
+        if (ring->sqes && ring->sqes != MAP_FAILED)
+            munmap(ring->sqes, ring->sqes_len);
+        if (ring->cq_ptr && ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr)
+            munmap(ring->cq_ptr, ring->cq_len);
+        if (ring->sq_ptr && ring->sq_ptr != MAP_FAILED)
+            munmap(ring->sq_ptr, ring->sq_len);
+        if (ring->ring_fd >= 0)
+            close(ring->ring_fd);
+        if (ring->ng_fd >= 0)
+            close(ring->ng_fd);
+    }
+
+    static int uring_setup(struct ss_io_engine *engine, const char *name)
+    {
+        struct ss_uring *ring = &engine->ring;
+        ring->ring_fd = ring->ng_fd = -1;
+
+        // the passthrough path needs the generic char device: nvme0n1 -> /dev/ng0n1
+        std::string dev(name);
+        if (dev.compare(0, 4, "nvme") != 0)
+            return -ENODEV;
+        std::string path = "/dev/ng" + dev.substr(4);
+        ring->ng_fd = open(path.c_str(), O_RDWR);
+        if (ring->ng_fd < 0)
+            return -errno;
+
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_SQE128 | IORING_SETUP_CQE32;
+        ring->ring_fd = syscall(__NR_io_uring_setup, engine->qdepth, &p);
+        if (ring->ring_fd < 0)
+        {
+            int ret = -errno;
+            uring_teardown(ring);
+            return ret;
+        }
+
+        ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_len = p.cq_off.cqes + p.cq_entries * SS_CQE_SIZE;
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            ring->sq_len = ring->cq_len = ring->sq_len > ring->cq_len ? ring->sq_len : ring->cq_len;
+        ring->sq_ptr = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+        if (p.features & IORING_FEAT_SINGLE_MMAP)
+            ring->cq_ptr = ring->sq_ptr;
+        else
+            ring->cq_ptr = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        ring->sqes_len = p.sq_entries * SS_SQE_SIZE;
+        ring->sqes = (char *)mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+        if (ring->sq_ptr == MAP_FAILED || ring->cq_ptr == MAP_FAILED || ring->sqes == MAP_FAILED)
+        {
+            int ret = -errno;
+            uring_teardown(ring);
+            return ret;
+        }
+
+        ring->sq_tail = (unsigned *)((char *)ring->sq_ptr + p.sq_off.tail);
+        ring->sq_mask = (unsigned *)((char *)ring->sq_ptr + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *)((char *)ring->sq_ptr + p.sq_off.array);
+        ring->cq_head = (unsigned *)((char *)ring->cq_ptr + p.cq_off.head);
+        ring->cq_tail = (unsigned *)((char *)ring->cq_ptr + p.cq_off.tail);
+        ring->cq_mask = (unsigned *)((char *)ring->cq_ptr + p.cq_off.ring_mask);
+        ring->cqes = (char *)ring->cq_ptr + p.cq_off.cqes;
+
+        int ret = pthread_create(&ring->reaper, NULL, &uring_reaper, engine);
+        if (ret)
+        {
+            uring_teardown(ring);
+            return -ret;
+        }
+        return 0;
+    }
+#endif
+
+    int ss_io_engine_init(struct ss_io_engine **engine, const char *name, int fd, uint32_t nsid, uint32_t lba_size, uint32_t qdepth)
+    {
+        struct ss_io_engine *e = (struct ss_io_engine *)calloc(1, sizeof(struct ss_io_engine));
+        if (!e)
+            return -ENOMEM;
+        e->fd = fd;
+        e->nsid = nsid;
+        e->lba_size = lba_size;
+        e->qdepth = qdepth ? qdepth : 1;
+        pthread_mutex_init(&e->mutex, NULL);
+        pthread_cond_init(&e->slot_free, NULL);
+        pthread_cond_init(&e->work, NULL);
+
+        int ret = -ENOTSUP;
+#ifdef SS_HAVE_URING_CMD
+        ret = uring_setup(e, name);
+#endif
+        if (!ret)
+        {
+            e->uring = true;
+            *engine = e;
+            return 0;
+        }
+
+        printf("INFO: io_uring passthrough unavailable for %s (%d), using %u I/O threads\n", name, ret, e->qdepth);
+        e->threads = (pthread_t *)calloc(e->qdepth, sizeof(pthread_t));
+        for (; e->thread_num < e->qdepth; e->thread_num++)
+        {
+            ret = pthread_create(&e->threads[e->thread_num], NULL, &io_worker, e);
+            if (ret)
+            {
+                printf("ERROR: failed to create I/O thread %d \n", ret);
+                ss_io_engine_destroy(e);
+                return -ret;
+            }
+        }
+        *engine = e;
+        return 0;
+    }
+
+    int ss_io_engine_submit(struct ss_io_engine *engine, enum ss_io_opcode op, uint64_t slba, void *buffer, uint32_t size,
+                            ss_io_callback cb, void *ctx)
+    {
+        if (size == 0 || size % engine->lba_size)
+            return -EINVAL;
+
+        struct ss_io_request *req = (struct ss_io_request *)calloc(1, sizeof(struct ss_io_request));
+        if (!req)
+            return -ENOMEM;
+        req->op = op;
+        req->slba = slba;
+        req->buffer = buffer;
+        req->size = size;
+        req->cb = cb;
+        req->ctx = ctx;
+
+        int ret = 0;
+        pthread_mutex_lock(&engine->mutex);
+        while (engine->inflight >= engine->qdepth)
+        {
+            pthread_cond_wait(&engine->slot_free, &engine->mutex);
+        }
+        engine->inflight++;
+#ifdef SS_HAVE_URING_CMD
+        if (engine->uring)
+        {
+            ret = uring_queue(engine, req);
+            if (ret)
+            {
+                engine->inflight--;
+                free(req);
+            }
+            pthread_mutex_unlock(&engine->mutex);
+            return ret;
+        }
+#endif
+        if (engine->tail)
+            engine->tail->next = req;
+        else
+            engine->head = req;
+        engine->tail = req;
+        pthread_cond_signal(&engine->work);
+        pthread_mutex_unlock(&engine->mutex);
+        return ret;
+    }
+
+    void ss_io_engine_destroy(struct ss_io_engine *engine)
+    {
+        pthread_mutex_lock(&engine->mutex);
+        while (engine->inflight)
+        {
+            pthread_cond_wait(&engine->slot_free, &engine->mutex);
+        }
+        engine->stop = true;
+        pthread_cond_broadcast(&engine->work);
+#ifdef SS_HAVE_URING_CMD
+        if (engine->uring)
+            uring_queue(engine, NULL);
+#endif
+        pthread_mutex_unlock(&engine->mutex);
+
+#ifdef SS_HAVE_URING_CMD
+        if (engine->uring)
+        {
+            pthread_join(engine->ring.reaper, NULL);
+            uring_teardown(&engine->ring);
+        }
+#endif
+        for (uint32_t i = 0; i < engine->thread_num; i++)
+        {
+            pthread_join(engine->threads[i], NULL);
+        }
+        free(engine->threads);
+        pthread_mutex_destroy(&engine->mutex);
+        pthread_cond_destroy(&engine->slot_free);
+        pthread_cond_destroy(&engine->work);
+        free(engine);
+    }
+
+    bool ss_io_engine_uses_uring(struct ss_io_engine *engine)
+    {
+        return engine->uring;
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_IO_ENGINE_H
+#define STOSYS_PROJECT_ZNS_IO_ENGINE_H
+
+#include <cstdint>
+
+extern "C"
+{
+    enum ss_io_opcode
+    {
+        SS_IO_READ,
+        SS_IO_WRITE,
+        SS_IO_APPEND,
+    };
+
+    // status is 0 on success, the NVMe status or a negative errno otherwise. result carries the written LBA of an append.
+    typedef void (*ss_io_callback)(void *ctx, int status, uint64_t result);
+
+    struct ss_io_engine;
+
+    // Queue-depth I/O engine for the FTL. Commands go through io_uring NVMe passthrough (IORING_OP_URING_CMD) on the
+    // generic char device (/dev/ngXnY) when the kernel supports it, otherwise a pool of qdepth threads issues the
+    // synchronous libnvme calls. Callbacks run on the engine threads and must not block on new submissions.
+    int ss_io_engine_init(struct ss_io_engine **engine, const char *name, int fd, uint32_t nsid, uint32_t lba_size, uint32_t qdepth);
+    // blocks while qdepth commands are in flight, size must be a multiple of the LBA size and fit in the MDTS
+    int ss_io_engine_submit(struct ss_io_engine *engine, enum ss_io_opcode op, uint64_t slba, void *buffer, uint32_t size,
+                            ss_io_callback cb, void *ctx);
+    // waits for all in-flight commands, then stops the engine threads
+    void ss_io_engine_destroy(struct ss_io_engine *engine);
+    bool ss_io_engine_uses_uring(struct ss_io_engine *engine);
+}
+
+#endif //STOSYS_PROJECT_ZNS_IO_ENGINE_H
@@ -0,0 +1,176 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "zns_latency.h"
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#include <vector>
+
+extern "C"
+{
+    struct ss_lat_thread
+    {
+        uint64_t epoch; // reset the maxima belong to
+        uint64_t max[SS_LAT_OPS_MAX];
+        uint64_t buckets[SS_LAT_OPS_MAX][SS_LAT_BUCKETS];
+    };
+
+    static pthread_mutex_t lat_mutex = PTHREAD_MUTEX_INITIALIZER;
+    static std::vector<struct ss_lat_thread *> lat_threads;
+    // bumped by ss_lat_destroy, a thread whose set is of an older generation registers a new one
+    static uint64_t lat_generation;
+    // bumped by ss_lat_reset, the counts at that point are the baseline snapshots subtract
+    static uint64_t lat_epoch;
+    static uint64_t lat_base[SS_LAT_OPS_MAX][SS_LAT_BUCKETS];
+    static thread_local struct ss_lat_thread *lat_self;
+    static thread_local uint64_t lat_self_generation;
+
+    uint64_t ss_lat_now()
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        return now.tv_sec * 1000000000ull + now.tv_nsec;
+    }
+
+    // values below 2^SS_LAT_SUB_BITS have a bucket each, above that every power of two is split into as many buckets
+    static uint32_t lat_bucket(uint64_t value)
+    {
+        if (value < (1 << SS_LAT_SUB_BITS))
+            return value;
+        int shift = 63 - __builtin_clzll(value) - SS_LAT_SUB_BITS;
+        return ((shift + 1) << SS_LAT_SUB_BITS) + (value >> shift) - (1 << SS_LAT_SUB_BITS);
+    }
+
+    // largest value that falls into a bucket
+    static uint64_t lat_bucket_top(uint32_t bucket)
+    {
+        if (bucket < (1 << SS_LAT_SUB_BITS))
+            return bucket;
+        uint32_t shift = (bucket >> SS_LAT_SUB_BITS) - 1;
+        uint64_t low = (uint64_t)((bucket & ((1 << SS_LAT_SUB_BITS) - 1)) + (1 << SS_LAT_SUB_BITS)) << shift;
+        return low + (1ull << shift) - 1;
+    }
+
+    static struct ss_lat_thread *lat_thread()
+    {
+        if (lat_self && lat_self_generation == __atomic_load_n(&lat_generation, __ATOMIC_ACQUIRE))
+            return lat_self;
+        struct ss_lat_thread *self = (struct ss_lat_thread *)calloc(1, sizeof(struct ss_lat_thread));
+        if (!self)
+            return NULL;
+        pthread_mutex_lock(&lat_mutex);
+        self->epoch = lat_epoch;
+        lat_threads.push_back(self);
+        lat_self_generation = lat_generation;
+        pthread_mutex_unlock(&lat_mutex);
+        lat_self = self;
+        return self;
+    }
+
+    void ss_lat_record(uint32_t op, uint64_t start)
+    {
+        uint64_t value = ss_lat_now() - start;
+        struct ss_lat_thread *self = lat_thread();
+        if (!self)
+            return;
+        // the owner is the only writer, plain increments published with relaxed stores are enough for snapshots
+        uint64_t epoch = __atomic_load_n(&lat_epoch, __ATOMIC_ACQUIRE);
+        if (self->epoch != epoch)
+        {
+            for (uint32_t i = 0; i < SS_LAT_OPS_MAX; i++)
+                __atomic_store_n(&self->max[i], 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&self->epoch, epoch, __ATOMIC_RELEASE);
+        }
+        uint64_t *bucket = &self->buckets[op][lat_bucket(value)];
+        __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+        if (value > self->max[op])
+            __atomic_store_n(&self->max[op], value, __ATOMIC_RELAXED);
+    }
+
+    void ss_lat_snapshot(uint32_t op, struct ss_lat_histogram *hist)
+    {
+        memset(hist, 0, sizeof(struct ss_lat_histogram));
+        pthread_mutex_lock(&lat_mutex);
+        for (auto iter = lat_threads.begin(); iter != lat_threads.end(); iter++)
+        {
+            struct ss_lat_thread *thread = *iter;
+            for (uint32_t i = 0; i < SS_LAT_BUCKETS; i++)
+                hist->buckets[i] += __atomic_load_n(&thread->buckets[op][i], __ATOMIC_RELAXED);
+            // a thread that did not record since the last reset still holds the maxima of an earlier epoch
+            uint64_t max = __atomic_load_n(&thread->max[op], __ATOMIC_RELAXED);
+            if (__atomic_load_n(&thread->epoch, __ATOMIC_ACQUIRE) == lat_epoch && max > hist->max)
+                hist->max = max;
+        }
+        for (uint32_t i = 0; i < SS_LAT_BUCKETS; i++)
+        {
+            hist->buckets[i] -= lat_base[op][i];
+            hist->count += hist->buckets[i];
+        }
+        pthread_mutex_unlock(&lat_mutex);
+    }
+
+    void ss_lat_reset()
+    {
+        pthread_mutex_lock(&lat_mutex);
+        memset(lat_base, 0, sizeof(lat_base));
+        for (auto iter = lat_threads.begin(); iter != lat_threads.end(); iter++)
+        {
+            for (uint32_t op = 0; op < SS_LAT_OPS_MAX; op++)
+            {
+                for (uint32_t i = 0; i < SS_LAT_BUCKETS; i++)
+                    lat_base[op][i] += __atomic_load_n(&(*iter)->buckets[op][i], __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_add_fetch(&lat_epoch, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lat_mutex);
+    }
+
+    uint64_t ss_lat_percentile(const struct ss_lat_histogram *hist, double q)
+    {
+        uint64_t rank = (uint64_t)ceil(q * hist->count), seen = 0;
+        rank = rank ? rank : 1;
+        for (uint32_t i = 0; hist->count && i < SS_LAT_BUCKETS; i++)
+        {
+            seen += hist->buckets[i];
+            if (seen < rank)
+                continue;
+            // the top of the bucket overestimates the slowest one
+            uint64_t top = lat_bucket_top(i);
+            return hist->max && hist->max < top ? hist->max : top;
+        }
+        return hist->max;
+    }
+
+    void ss_lat_destroy()
+    {
+        pthread_mutex_lock(&lat_mutex);
+        for (auto iter = lat_threads.begin(); iter != lat_threads.end(); iter++)
+            free(*iter);
+        lat_threads.clear();
+        memset(lat_base, 0, sizeof(lat_base));
+        __atomic_add_fetch(&lat_generation, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lat_mutex);
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_LATENCY_H
+#define STOSYS_PROJECT_ZNS_LATENCY_H
+
+#include <cstdint>
+
+// sub-buckets per power of two, a bucket is within 1/16 of the latencies it holds
+#define SS_LAT_SUB_BITS 4
+#define SS_LAT_BUCKETS ((64 - SS_LAT_SUB_BITS + 1) << SS_LAT_SUB_BITS)
+#define SS_LAT_OPS_MAX 8
+
+extern "C"
+{
+    // Log-linear latency histograms in nanoseconds, one set per thread that records. A thread only ever writes its
+    // own set, so recording takes neither a lock nor an atomic read-modify-write. Snapshots sum the sets up.
+    struct ss_lat_histogram
+    {
+        uint64_t count;
+        uint64_t max;
+        uint64_t buckets[SS_LAT_BUCKETS];
+    };
+
+    uint64_t ss_lat_now();
+    // records the time since start, taken with ss_lat_now, for operation op < SS_LAT_OPS_MAX
+    void ss_lat_record(uint32_t op, uint64_t start);
+    // the latencies of op since the last reset
+    void ss_lat_snapshot(uint32_t op, struct ss_lat_histogram *hist);
+    void ss_lat_reset();
+    // smallest latency that q of the recorded ones do not exceed, up to the bucket resolution
+    uint64_t ss_lat_percentile(const struct ss_lat_histogram *hist, double q);
+    // drops the per-thread sets, no thread may record concurrently
+    void ss_lat_destroy();
+}
+
+#endif //STOSYS_PROJECT_ZNS_LATENCY_H
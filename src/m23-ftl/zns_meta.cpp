@@ -0,0 +1,387 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "zns_meta.h"
+#include "libnvme.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+#define SS_META_MAGIC 0x4154454d // "META"
+
+extern "C"
+{
+    struct ss_meta_header
+    {
+        uint32_t magic;
+        uint32_t type;
+        uint64_t epoch;
+        uint64_t seq;   // record number within the epoch
+        uint64_t total; // checkpoint bytes, a checkpoint is split over as many records as it needs
+        uint32_t size;  // payload bytes of this record
+        uint32_t crc;   // of the header with crc 0 and the payload
+    };
+
+    struct ss_meta_log
+    {
+        int fd;
+        uint32_t nsid;
+        uint32_t lba_size;
+        uint32_t blocks_per_zone;
+        uint32_t first_zone;
+        uint32_t zones;
+        uint32_t max_record; // bytes of the largest record, header included, one append
+        uint32_t *wp;        // blocks written to each zone of the region
+        char *buffer;
+        uint64_t epoch;
+        uint64_t max_epoch; // highest epoch on the device, new checkpoints go above it
+        uint64_t seq;
+        int64_t start;  // zone the checkpoint of the current epoch starts in, -1 if there is none
+        int64_t fence;  // zone records must not advance into, it holds the checkpoint the device would recover
+        uint32_t cur;   // zone records are appended to
+        bool open;      // the current epoch takes journal records
+        uint64_t bytes_written;
+        uint64_t bytes_read;
+        uint64_t resets;
+    };
+
+    static uint32_t crc_table[256];
+
+    uint32_t ss_meta_crc(uint32_t crc, const void *data, uint64_t size)
+    {
+        const uint8_t *p = (const uint8_t *)data;
+        crc = ~crc;
+        while (size--)
+            crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        return ~crc;
+    }
+
+    static uint32_t record_blocks(struct ss_meta_log *log, uint32_t size)
+    {
+        return (sizeof(struct ss_meta_header) + size + log->lba_size - 1) / log->lba_size;
+    }
+
+    static uint64_t zone_slba(struct ss_meta_log *log, uint32_t zone)
+    {
+        return (uint64_t)(log->first_zone + zone) * log->blocks_per_zone;
+    }
+
+    int ss_meta_log_init(struct ss_meta_log **log, int fd, uint32_t nsid, uint32_t lba_size, uint32_t blocks_per_zone,
+                         uint32_t first_zone, uint32_t zones, uint32_t max_record)
+    {
+        if (zones < 2)
+        {
+            printf("ERROR: the metadata region needs at least 2 zones, got %u\n", zones);
+            return -EINVAL;
+        }
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            crc_table[i] = c;
+        }
+
+        struct ss_meta_log *l = (struct ss_meta_log *)calloc(1, sizeof(struct ss_meta_log));
+        if (!l)
+            return -ENOMEM;
+        l->fd = fd;
+        l->nsid = nsid;
+        l->lba_size = lba_size;
+        l->blocks_per_zone = blocks_per_zone;
+        l->first_zone = first_zone;
+        l->zones = zones;
+        l->max_record = std::min((uint64_t)max_record, (uint64_t)blocks_per_zone * lba_size);
+        l->max_record -= l->max_record % lba_size;
+        l->wp = (uint32_t *)calloc(zones, sizeof(uint32_t));
+        if (!l->wp || posix_memalign((void **)&l->buffer, 4096, l->max_record))
+        {
+            free(l->wp);
+            free(l);
+            return -ENOMEM;
+        }
+        l->start = l->fence = -1;
+        *log = l;
+        return 0;
+    }
+
+    void ss_meta_log_destroy(struct ss_meta_log *log)
+    {
+        free(log->wp);
+        free(log->buffer);
+        free(log);
+    }
+
+    void ss_meta_log_io(struct ss_meta_log *log, uint64_t *written, uint64_t *read, uint64_t *resets)
+    {
+        *written = log->bytes_written;
+        *read = log->bytes_read;
+        *resets = log->resets;
+    }
+
+    uint32_t ss_meta_log_max_payload(struct ss_meta_log *log)
+    {
+        return log->max_record - sizeof(struct ss_meta_header);
+    }
+
+    static int meta_zone_reset(struct ss_meta_log *log, uint32_t zone)
+    {
+        int ret = nvme_zns_mgmt_send(log->fd, log->nsid, zone_slba(log, zone), false, NVME_ZNS_ZSA_RESET, 0, NULL);
+        if (ret)
+        {
+            printf("ERROR: failed to reset metadata zone %u, ret: %d\n", log->first_zone + zone, ret);
+            return ret;
+        }
+        log->wp[zone] = 0;
+        log->resets++;
+        return 0;
+    }
+
+    // append one record to the current zone, a record that does not fit moves on to the next zone if advance is set
+    static int meta_write(struct ss_meta_log *log, enum ss_meta_record type, const char *payload, uint32_t size,
+                          uint64_t total, bool advance)
+    {
+        uint32_t blocks = record_blocks(log, size);
+        if (log->wp[log->cur] + blocks > log->blocks_per_zone)
+        {
+            uint32_t next = (log->cur + 1) % log->zones;
+            if (!advance)
+                return -ENOSPC;
+            if ((int64_t)next == log->fence)
+            {
+                printf("ERROR: the metadata region of %u zones is too small for a checkpoint\n", log->zones);
+                return -ENOSPC;
+            }
+            int ret = meta_zone_reset(log, next);
+            if (ret)
+                return ret;
+            log->cur = next;
+        }
+
+        struct ss_meta_header *hdr = (struct ss_meta_header *)log->buffer;
+        hdr->magic = SS_META_MAGIC;
+        hdr->type = type;
+        hdr->epoch = log->epoch;
+        hdr->seq = log->seq;
+        hdr->total = total;
+        hdr->size = size;
+        hdr->crc = 0;
+        memcpy(log->buffer + sizeof(*hdr), payload, size);
+        memset(log->buffer + sizeof(*hdr) + size, 0, blocks * log->lba_size - sizeof(*hdr) - size);
+        hdr->crc = ss_meta_crc(0, log->buffer, sizeof(*hdr) + size);
+
+        __u64 res_lba;
+        int ret = nvme_zns_append(log->fd, log->nsid, zone_slba(log, log->cur), blocks - 1, 0, 0, 0, 0,
+                                  blocks * log->lba_size, log->buffer, 0, NULL, &res_lba);
+        if (ret)
+        {
+            // the zone write pointer is unknown now, continue in a fresh zone with a new checkpoint
+            printf("ERROR: failed to append to metadata zone %u, ret: %d\n", log->first_zone + log->cur, ret);
+            log->open = false;
+            return ret;
+        }
+        log->wp[log->cur] += blocks;
+        log->bytes_written += blocks * log->lba_size;
+        log->seq++;
+        return 0;
+    }
+
+    int ss_meta_log_journal(struct ss_meta_log *log, const void *payload, uint32_t size)
+    {
+        if (size > ss_meta_log_max_payload(log))
+            return -EINVAL;
+        if (!log->open)
+            return -ENOSPC;
+        return meta_write(log, SS_META_JOURNAL, (const char *)payload, size, 0, false);
+    }
+
+    int ss_meta_log_checkpoint(struct ss_meta_log *log, const void *payload, uint64_t size)
+    {
+        // the new epoch starts in a zone of its own, the current one stays recoverable until the checkpoint is complete
+        uint32_t first = log->start == -1 ? log->cur : (log->cur + 1) % log->zones;
+        if ((int64_t)first == log->start)
+            return -ENOSPC;
+        if (log->wp[first])
+        {
+            int ret = meta_zone_reset(log, first);
+            if (ret)
+                return ret;
+        }
+
+        log->open = false;
+        log->cur = first;
+        log->fence = log->start == -1 ? first : log->start;
+        log->epoch = ++log->max_epoch;
+        log->seq = 0;
+        uint64_t chunk = ss_meta_log_max_payload(log), off = 0;
+        do
+        {
+            uint32_t n = std::min(chunk, size - off);
+            int ret = meta_write(log, SS_META_CHECKPOINT, (const char *)payload + off, n, size, true);
+            if (ret)
+                return ret;
+            off += n;
+        } while (off < size);
+
+        log->start = log->fence = first;
+        log->open = true;
+        return 0;
+    }
+
+    // read the record at block off of a zone into the buffer, NULL if there is no valid record
+    static struct ss_meta_header *meta_read(struct ss_meta_log *log, uint32_t zone, uint32_t off)
+    {
+        struct ss_meta_header *hdr = (struct ss_meta_header *)log->buffer;
+        uint64_t slba = zone_slba(log, zone) + off;
+        if (off >= log->wp[zone])
+            return NULL;
+        if (nvme_read(log->fd, log->nsid, slba, 0, 0, 0, 0, 0, 0, log->lba_size, log->buffer, 0, NULL))
+            return NULL;
+        log->bytes_read += log->lba_size;
+        if (hdr->magic != SS_META_MAGIC || hdr->size > ss_meta_log_max_payload(log))
+            return NULL;
+
+        uint32_t blocks = record_blocks(log, hdr->size);
+        if (off + blocks > log->wp[zone])
+            return NULL;
+        if (blocks > 1 && nvme_read(log->fd, log->nsid, slba + 1, blocks - 2, 0, 0, 0, 0, 0, (blocks - 1) * log->lba_size,
+                                    log->buffer + log->lba_size, 0, NULL))
+            return NULL;
+        log->bytes_read += (blocks - 1) * log->lba_size;
+
+        uint32_t crc = hdr->crc;
+        hdr->crc = 0;
+        bool valid = ss_meta_crc(0, log->buffer, sizeof(*hdr) + hdr->size) == crc;
+        hdr->crc = crc;
+        return valid ? hdr : NULL;
+    }
+
+    // replay the epoch whose checkpoint starts in zone, -EAGAIN if that checkpoint never completed
+    static int meta_replay(struct ss_meta_log *log, uint32_t zone, uint64_t epoch, ss_meta_apply apply, void *ctx)
+    {
+        std::vector<char> checkpoint;
+        uint64_t seq = 0, total = 0;
+        uint32_t z = zone, off = 0;
+        bool restored = false;
+        int ret = 0;
+        while (1)
+        {
+            struct ss_meta_header *hdr = meta_read(log, z, off);
+            if (!hdr || hdr->epoch != epoch || hdr->seq != seq)
+            {
+                // records move on to the next zone only once the current one cannot take them
+                uint32_t next = (z + 1) % log->zones;
+                if (off != log->wp[z] || next == zone || !(hdr = meta_read(log, next, 0)) || hdr->epoch != epoch ||
+                    hdr->seq != seq)
+                    break;
+                z = next;
+                off = 0;
+            }
+
+            char *payload = (char *)hdr + sizeof(*hdr);
+            if (hdr->type == SS_META_CHECKPOINT && !restored)
+            {
+                if (seq == 0)
+                    total = hdr->total;
+                if (hdr->total != total || checkpoint.size() + hdr->size > total)
+                    break;
+                checkpoint.insert(checkpoint.end(), payload, payload + hdr->size);
+                if (checkpoint.size() == total)
+                {
+                    restored = true;
+                    ret = apply(ctx, SS_META_CHECKPOINT, checkpoint.data(), total);
+                    std::vector<char>().swap(checkpoint);
+                }
+            }
+            else if (hdr->type == SS_META_JOURNAL && restored)
+                ret = apply(ctx, SS_META_JOURNAL, payload, hdr->size);
+            else
+                break;
+            if (ret)
+                return ret;
+            off += record_blocks(log, hdr->size);
+            seq++;
+        }
+        if (!restored)
+            return -EAGAIN;
+
+        log->epoch = epoch;
+        log->seq = seq;
+        log->start = log->fence = zone;
+        log->cur = z;
+        log->open = true;
+        // a torn record at the end is garbage the journal cannot append behind, start over with a checkpoint
+        return off != log->wp[z];
+    }
+
+    int ss_meta_log_recover(struct ss_meta_log *log, ss_meta_apply apply, void *ctx)
+    {
+        uint64_t size = sizeof(struct nvme_zone_report) + log->zones * sizeof(struct nvme_zns_desc);
+        struct nvme_zone_report *report = (struct nvme_zone_report *)calloc(1, size);
+        if (!report)
+            return -ENOMEM;
+        int ret = nvme_zns_mgmt_recv(log->fd, log->nsid, zone_slba(log, 0), NVME_ZNS_ZRA_REPORT_ZONES,
+                                     NVME_ZNS_ZRAS_REPORT_ALL, 1, size, report);
+        if (ret)
+        {
+            printf("ERROR: failed to report the metadata zones, ret: %d\n", ret);
+            free(report);
+            return ret;
+        }
+        for (uint32_t i = 0; i < log->zones; i++)
+        {
+            struct nvme_zns_desc *desc = &report->entries[i];
+            log->wp[i] = (desc->zs >> 4) == NVME_ZNS_ZS_FULL ? log->blocks_per_zone : desc->wp - desc->zslba;
+        }
+        free(report);
+
+        // every epoch starts at the beginning of a zone, try the newest first
+        std::vector<std::pair<uint64_t, uint32_t>> starts;
+        for (uint32_t i = 0; i < log->zones; i++)
+        {
+            struct ss_meta_header *hdr = meta_read(log, i, 0);
+            if (!hdr)
+                continue;
+            log->max_epoch = std::max(log->max_epoch, hdr->epoch);
+            if (hdr->type == SS_META_CHECKPOINT && hdr->seq == 0)
+                starts.push_back(std::make_pair(hdr->epoch, i));
+        }
+        std::sort(starts.begin(), starts.end(), std::greater<std::pair<uint64_t, uint32_t>>());
+
+        for (auto iter = starts.begin(); iter != starts.end(); iter++)
+        {
+            ret = meta_replay(log, iter->second, iter->first, apply, ctx);
+            if (ret != -EAGAIN)
+                return ret;
+            printf("INFO: checkpoint of metadata epoch %lu is incomplete, falling back to an older one\n", iter->first);
+        }
+
+        log->start = log->fence = -1;
+        log->cur = 0;
+        log->open = false;
+        return 1;
+    }
+}
@@ -0,0 +1,63 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_META_H
+#define STOSYS_PROJECT_ZNS_META_H
+
+#include <cstdint>
+
+extern "C"
+{
+    enum ss_meta_record
+    {
+        SS_META_CHECKPOINT = 1,
+        SS_META_JOURNAL = 2,
+    };
+
+    // called once with the whole checkpoint, then once per journal record in the order they were written
+    typedef int (*ss_meta_apply)(void *ctx, enum ss_meta_record type, const void *payload, uint64_t size);
+
+    struct ss_meta_log;
+
+    // Metadata region of the FTL, a ring of zones holding checksummed records. Each epoch starts with a checkpoint,
+    // which may span zones, followed by journal records in the zone the checkpoint ended in. Once that zone is full
+    // the owner writes the next checkpoint into the following zones, the previous epoch stays intact until it is
+    // complete. Not thread safe, callers serialise all calls.
+    int ss_meta_log_init(struct ss_meta_log **log, int fd, uint32_t nsid, uint32_t lba_size, uint32_t blocks_per_zone,
+                         uint32_t first_zone, uint32_t zones, uint32_t max_record);
+    // replays the newest complete checkpoint and its journal, returns 1 if a checkpoint has to be written before the
+    // next journal record (empty region or torn tail), 0 if the journal can be continued, < 0 on errors
+    int ss_meta_log_recover(struct ss_meta_log *log, ss_meta_apply apply, void *ctx);
+    // appends one journal record, durable on return. -ENOSPC means the epoch is full and a checkpoint is due.
+    int ss_meta_log_journal(struct ss_meta_log *log, const void *payload, uint32_t size);
+    // writes a checkpoint that starts a new epoch, durable on return
+    int ss_meta_log_checkpoint(struct ss_meta_log *log, const void *payload, uint64_t size);
+    // largest journal payload a single record takes
+    uint32_t ss_meta_log_max_payload(struct ss_meta_log *log);
+    // bytes written to and read from the region and zones reset since init
+    void ss_meta_log_io(struct ss_meta_log *log, uint64_t *written, uint64_t *read, uint64_t *resets);
+    void ss_meta_log_destroy(struct ss_meta_log *log);
+    // CRC-32 the records are checked with, usable for other on-device metadata once a log was initialised
+    uint32_t ss_meta_crc(uint32_t crc, const void *data, uint64_t size);
+}
+
+#endif //STOSYS_PROJECT_ZNS_META_H
@@ -0,0 +1,269 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#include "zns_zones.h"
+#include "libnvme.h"
+#include <cerrno>
+#include <cstdio>
+#include <pthread.h>
+#include <vector>
+
+extern "C"
+{
+    enum ss_zone_state
+    {
+        SS_ZONE_EMPTY,
+        SS_ZONE_OPEN,
+        SS_ZONE_CLOSED,
+        SS_ZONE_FULL,
+    };
+
+    struct ss_zone
+    {
+        uint8_t state;
+        bool idle;
+        uint32_t writers; // writes in flight, such a zone is neither closed nor finished
+        uint32_t wp;      // blocks written, counted when the writes complete
+        uint64_t last_write;
+    };
+
+    struct ss_zone_mgr
+    {
+        pthread_mutex_t mutex;
+        pthread_cond_t changed; // a write finished or a zone was reset, an open zone may be closable now
+        int fd;
+        uint32_t nsid;
+        uint32_t blocks_per_zone;
+        uint32_t max_open;
+        uint32_t max_active;
+        uint32_t open;
+        uint32_t active; // open or closed
+        uint64_t clock;
+        uint64_t closes;
+        uint64_t finishes;
+        std::vector<struct ss_zone> zones;
+    };
+
+    // caller holds the mutex, the least recently written zone without a write in flight that is in `state` (and idle
+    // if idle is set), -1 if there is none
+    static int64_t zone_lru(struct ss_zone_mgr *mgr, uint8_t state, bool idle)
+    {
+        int64_t lru = -1;
+        for (uint64_t i = 0; i < mgr->zones.size(); i++)
+        {
+            struct ss_zone *z = &mgr->zones[i];
+            if (z->state != state || z->writers || (idle && !z->idle))
+                continue;
+            if (lru == -1 || z->last_write < mgr->zones[lru].last_write)
+                lru = i;
+        }
+        return lru;
+    }
+
+    static int zone_send(struct ss_zone_mgr *mgr, uint64_t zone, enum nvme_zns_send_action action)
+    {
+        return nvme_zns_mgmt_send(mgr->fd, mgr->nsid, zone * mgr->blocks_per_zone, false, action, 0, NULL);
+    }
+
+    // caller holds the mutex, finishes the least recently written idle zone, closed ones first since they already
+    // gave up their open resource
+    static int zone_finish_lru(struct ss_zone_mgr *mgr)
+    {
+        int64_t zone = zone_lru(mgr, SS_ZONE_CLOSED, true);
+        if (zone == -1)
+            zone = zone_lru(mgr, SS_ZONE_OPEN, true);
+        if (zone == -1)
+            return -EBUSY;
+        int ret = zone_send(mgr, zone, NVME_ZNS_ZSA_FINISH);
+        if (ret)
+            return ret;
+        struct ss_zone *z = &mgr->zones[zone];
+        mgr->open -= z->state == SS_ZONE_OPEN;
+        mgr->active--;
+        z->state = SS_ZONE_FULL;
+        mgr->finishes++;
+        return 0;
+    }
+
+    // caller holds the mutex, closes the least recently written open zone, -EAGAIN if every open zone has writes in
+    // flight
+    static int zone_close_lru(struct ss_zone_mgr *mgr)
+    {
+        int64_t zone = zone_lru(mgr, SS_ZONE_OPEN, false);
+        if (zone == -1)
+            return -EAGAIN;
+        int ret = zone_send(mgr, zone, NVME_ZNS_ZSA_CLOSE);
+        if (ret)
+            return ret;
+        mgr->zones[zone].state = SS_ZONE_CLOSED;
+        mgr->open--;
+        mgr->closes++;
+        return 0;
+    }
+
+    int ss_zone_mgr_init(struct ss_zone_mgr **mgr, int fd, uint32_t nsid, uint32_t zones, uint32_t blocks_per_zone,
+                         uint32_t max_open, uint32_t max_active)
+    {
+        struct ss_zone_mgr *m = new ss_zone_mgr();
+        pthread_mutex_init(&m->mutex, NULL);
+        pthread_cond_init(&m->changed, NULL);
+        m->fd = fd;
+        m->nsid = nsid;
+        m->blocks_per_zone = blocks_per_zone;
+        // the metadata region keeps one of each
+        m->max_open = max_open == UINT32_MAX ? UINT32_MAX : max_open > 2 ? max_open - 1 : 1;
+        m->max_active = max_active == UINT32_MAX ? UINT32_MAX : max_active > 2 ? max_active - 1 : 1;
+        m->zones.assign(zones, {SS_ZONE_EMPTY, false, 0, 0, 0});
+        *mgr = m;
+        return 0;
+    }
+
+    void ss_zone_mgr_load(struct ss_zone_mgr *mgr, uint32_t zone, uint8_t state, uint32_t wp)
+    {
+        if (zone >= mgr->zones.size())
+            return;
+        struct ss_zone *z = &mgr->zones[zone];
+        z->wp = wp;
+        z->idle = true;
+        if (state == NVME_ZNS_ZS_EMPTY)
+            z->state = SS_ZONE_EMPTY;
+        else if (state == NVME_ZNS_ZS_IMPL_OPEN || state == NVME_ZNS_ZS_EXPL_OPEN)
+            z->state = SS_ZONE_OPEN;
+        else if (state == NVME_ZNS_ZS_CLOSED)
+            z->state = SS_ZONE_CLOSED;
+        else
+            z->state = SS_ZONE_FULL;
+        mgr->open += z->state == SS_ZONE_OPEN;
+        mgr->active += z->state == SS_ZONE_OPEN || z->state == SS_ZONE_CLOSED;
+    }
+
+    int ss_zone_write_begin(struct ss_zone_mgr *mgr, uint32_t zone)
+    {
+        if (zone >= mgr->zones.size())
+            return 0;
+        int ret = 0;
+        pthread_mutex_lock(&mgr->mutex);
+        struct ss_zone *z = &mgr->zones[zone];
+        z->writers++;
+        z->last_write = ++mgr->clock;
+        while (z->state == SS_ZONE_EMPTY || z->state == SS_ZONE_CLOSED)
+        {
+            if (z->state == SS_ZONE_EMPTY && mgr->active >= mgr->max_active && (ret = zone_finish_lru(mgr)))
+                break;
+            if (mgr->open >= mgr->max_open && (ret = zone_close_lru(mgr)))
+            {
+                // the open zones are all being written, one of them fills up or finishes its write soon
+                if (ret != -EAGAIN)
+                    break;
+                ret = 0;
+                pthread_cond_wait(&mgr->changed, &mgr->mutex);
+                continue;
+            }
+            if ((ret = zone_send(mgr, zone, NVME_ZNS_ZSA_OPEN)))
+                break;
+            mgr->active += z->state == SS_ZONE_EMPTY;
+            mgr->open++;
+            z->state = SS_ZONE_OPEN;
+        }
+        pthread_mutex_unlock(&mgr->mutex);
+        if (ret)
+            printf("ERROR: failed to open zone %u within %u open and %u active zones, ret: %d\n", zone, mgr->max_open,
+                   mgr->max_active, ret);
+        return ret;
+    }
+
+    void ss_zone_write_end(struct ss_zone_mgr *mgr, uint32_t zone, uint32_t blocks)
+    {
+        if (zone >= mgr->zones.size())
+            return;
+        pthread_mutex_lock(&mgr->mutex);
+        struct ss_zone *z = &mgr->zones[zone];
+        z->writers--;
+        z->wp += blocks;
+        // the controller moves a zone to full by itself once it is written up to its capacity
+        if (z->wp >= mgr->blocks_per_zone && z->state != SS_ZONE_FULL)
+        {
+            mgr->open -= z->state == SS_ZONE_OPEN;
+            mgr->active -= z->state == SS_ZONE_OPEN || z->state == SS_ZONE_CLOSED;
+            z->state = SS_ZONE_FULL;
+        }
+        pthread_cond_broadcast(&mgr->changed);
+        pthread_mutex_unlock(&mgr->mutex);
+    }
+
+    void ss_zone_idle(struct ss_zone_mgr *mgr, uint32_t zone)
+    {
+        if (zone >= mgr->zones.size())
+            return;
+        pthread_mutex_lock(&mgr->mutex);
+        mgr->zones[zone].idle = true;
+        pthread_mutex_unlock(&mgr->mutex);
+    }
+
+    bool ss_zone_claim(struct ss_zone_mgr *mgr, uint32_t zone)
+    {
+        if (zone >= mgr->zones.size())
+            return true;
+        pthread_mutex_lock(&mgr->mutex);
+        struct ss_zone *z = &mgr->zones[zone];
+        bool writable = z->state != SS_ZONE_FULL;
+        if (writable)
+            z->idle = false;
+        pthread_mutex_unlock(&mgr->mutex);
+        return writable;
+    }
+
+    void ss_zone_reset_done(struct ss_zone_mgr *mgr, uint32_t zone)
+    {
+        if (zone >= mgr->zones.size())
+            return;
+        pthread_mutex_lock(&mgr->mutex);
+        struct ss_zone *z = &mgr->zones[zone];
+        mgr->open -= z->state == SS_ZONE_OPEN;
+        mgr->active -= z->state == SS_ZONE_OPEN || z->state == SS_ZONE_CLOSED;
+        z->state = SS_ZONE_EMPTY;
+        z->idle = false;
+        z->wp = 0;
+        pthread_cond_broadcast(&mgr->changed);
+        pthread_mutex_unlock(&mgr->mutex);
+    }
+
+    void ss_zone_mgr_counters(struct ss_zone_mgr *mgr, uint64_t *closes, uint64_t *finishes)
+    {
+        pthread_mutex_lock(&mgr->mutex);
+        *closes = mgr->closes;
+        *finishes = mgr->finishes;
+        pthread_mutex_unlock(&mgr->mutex);
+    }
+
+    void ss_zone_mgr_destroy(struct ss_zone_mgr *mgr)
+    {
+        for (uint64_t i = 0; i < mgr->zones.size(); i++)
+        {
+            if (mgr->zones[i].state == SS_ZONE_OPEN)
+                zone_send(mgr, i, NVME_ZNS_ZSA_CLOSE);
+        }
+        pthread_mutex_destroy(&mgr->mutex);
+        pthread_cond_destroy(&mgr->changed);
+        delete mgr;
+    }
+}
@@ -0,0 +1,56 @@
+/*
+ * MIT License
+Copyright (c) 2021 - current
+Authors:  Animesh Trivedi
+This code is part of the Storage System Course at VU Amsterdam
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+ */
+
+#ifndef STOSYS_PROJECT_ZNS_ZONES_H
+#define STOSYS_PROJECT_ZNS_ZONES_H
+
+#include <cstdint>
+
+extern "C"
+{
+    struct ss_zone_mgr;
+
+    // Keeps the zones the FTL writes within the open and active limits of the namespace (MOR + 1 and MAR + 1,
+    // UINT32_MAX without a limit). Zones are opened explicitly before they are written, so the controller never closes
+    // one on its own. With max_open zones open the least recently written zone without a write in flight is closed,
+    // with max_active zones open or closed the least recently written idle zone, one the FTL stopped writing before it
+    // was full, is finished. Zones from `zones` on (the metadata region) are not tracked, they open implicitly and get
+    // one open and one active zone of their own.
+    int ss_zone_mgr_init(struct ss_zone_mgr **mgr, int fd, uint32_t nsid, uint32_t zones, uint32_t blocks_per_zone,
+                         uint32_t max_open, uint32_t max_active);
+    // state of a zone at mount, state as in the zone report and wp relative to the zone start. Zones written before
+    // the mount are idle.
+    void ss_zone_mgr_load(struct ss_zone_mgr *mgr, uint32_t zone, uint8_t state, uint32_t wp);
+    // every write to a zone is bracketed by these two, also when begin fails. end takes the blocks written, 0 on error.
+    int ss_zone_write_begin(struct ss_zone_mgr *mgr, uint32_t zone);
+    void ss_zone_write_end(struct ss_zone_mgr *mgr, uint32_t zone, uint32_t blocks);
+    // the FTL will not write the zone again before it is reset, so it may be finished
+    void ss_zone_idle(struct ss_zone_mgr *mgr, uint32_t zone);
+    // takes an idle zone back for more writes, false if it was finished meanwhile
+    bool ss_zone_claim(struct ss_zone_mgr *mgr, uint32_t zone);
+    void ss_zone_reset_done(struct ss_zone_mgr *mgr, uint32_t zone);
+    void ss_zone_mgr_counters(struct ss_zone_mgr *mgr, uint64_t *closes, uint64_t *finishes);
+    // closes the zones that are still open
+    void ss_zone_mgr_destroy(struct ss_zone_mgr *mgr);
+}
+
+#endif //STOSYS_PROJECT_ZNS_ZONES_H
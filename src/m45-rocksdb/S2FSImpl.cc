@@ -57,6 +57,25 @@ namespace ROCKSDB_NAMESPACE
         return IOStatus::OK();
     }
 
+    // the appends are on the device already, only the write buffer of the FTL may still hold some
+    IOStatus S2FSDirectory::Fsync(const IOOptions &options, IODebugContext *dbg)
+    {
+        if (zns_udevice_flush(S2FSObject::_fs->_zns_dev))
+        {
+            return IOStatus::IOError();
+        }
+        return IOStatus::OK();
+    }
+
+    IOStatus S2FSWritableFile::Sync(const IOOptions &options, IODebugContext *dbg)
+    {
+        if (zns_udevice_flush(S2FSObject::_fs->_zns_dev))
+        {
+            return IOStatus::IOError();
+        }
+        return IOStatus::OK();
+    }
+
     IOStatus S2FSRandomAccessFile::Read(uint64_t offset, size_t n, const IOOptions &options,
                                         Slice *result, char *scratch,
                                         IODebugContext *dbg) const
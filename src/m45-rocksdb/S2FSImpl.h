@@ -41,10 +41,7 @@ namespace ROCKSDB_NAMESPACE
         {}
         ~S2FSDirectory() {}
 
-        virtual IOStatus Fsync(const IOOptions& options, IODebugContext* dbg) 
-        {
-            return IOStatus::OK();
-        }
+        virtual IOStatus Fsync(const IOOptions& options, IODebugContext* dbg);
 
         virtual size_t GetUniqueId(char* /*id*/, size_t /*max_size*/) const {
             return 0;
@@ -94,10 +91,7 @@ namespace ROCKSDB_NAMESPACE
         }
 
         virtual IOStatus Sync(const IOOptions &options,
-                              IODebugContext *dbg)
-        {
-            return IOStatus::OK();
-        } // sync data
+                              IODebugContext *dbg); // sync data
     };
 
     class S2FSRandomAccessFile : public FSRandomAccessFile
@@ -315,15 +315,19 @@ namespace ROCKSDB_NAMESPACE
 
         memset(_buffer + size, 0, S2FSSegment::Size() - size);
         size = round_up(size, S2FSBlock::Size());
+        std::vector<struct zns_iovec> iov;
         for (size_t i = _addr_start; i < _addr_start + size; i += S2FSBlock::Size())
         {
-            int ret = zns_udevice_write(_fs->_zns_dev, i, _buffer + i - _addr_start, S2FSBlock::Size());
-            if (ret)
-            {
-                std::cout << "Error: nvme write error at: " << i << " ret:" << ret << " during S2FSSegment::Flush."
-                        << "\n";
-                return -1;
-            }
+            iov.push_back({i, _buffer + i - _addr_start, (uint32_t)S2FSBlock::Size()});
+        }
+
+        // the whole dirty segment goes down in one call, the FTL packs it into as few appends as it can
+        int ret = zns_udevice_writev(_fs->_zns_dev, iov.data(), iov.size());
+        if (ret)
+        {
+            std::cout << "Error: nvme write error at: " << _addr_start << " ret:" << ret << " during S2FSSegment::Flush."
+                    << "\n";
+            return -1;
         }
         return 0;
     }
@@ -342,15 +346,18 @@ namespace ROCKSDB_NAMESPACE
             write_end = _reserve_for_inode * S2FSBlock::Size();
         }
 
+        std::vector<struct zns_iovec> iov;
         for (size_t i = write_start; i < write_end; i += S2FSBlock::Size())
         {
-            int ret = zns_udevice_write(_fs->_zns_dev, i + _addr_start, _buffer + i - write_start, S2FSBlock::Size());
-            if (ret)
-            {
-                std::cout << "Error: nvme write error at: " << i + _addr_start << " ret:" << ret << " during S2FSSegment::Flush."
-                        << "\n";
-                return -1;
-            }
+            iov.push_back({i + _addr_start, _buffer + i - write_start, (uint32_t)S2FSBlock::Size()});
+        }
+
+        int ret = zns_udevice_writev(_fs->_zns_dev, iov.data(), iov.size());
+        if (ret)
+        {
+            std::cout << "Error: nvme write error at: " << write_start + _addr_start << " ret:" << ret << " during S2FSSegment::Flush."
+                    << "\n";
+            return -1;
         }
         return write_end - write_start;
     }
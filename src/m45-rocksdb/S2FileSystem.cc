@@ -74,6 +74,22 @@ namespace ROCKSDB_NAMESPACE
         params.name = strdup(device.c_str());
         params.log_zones = 3;
         params.gc_wmark = 1;
+        params.gc_soft_wmark = 2;
+        params.io_depth = 32;
+        params.merge_workers = 4;
+        params.meta_zones = 2;
+        // sequential SST writes are merged by switching log zones in, which log summaries rule out
+        params.log_summaries = false;
+        params.wear_level_threshold = 64;
+        params.hot_cold_streams = false;
+        params.log_lanes = 1;
+        params.read_cache_bytes = 64 << 20;
+        // S2FS writes through zns_udevice_writev, which the write buffer does not take, so it stays off. Sync and
+        // Fsync flush it all the same.
+        params.write_buffer_bytes = 0;
+        params.write_buffer_flush_us = 0;
+        // SST files are written front to back, they skip the log and the merge
+        params.seq_streams = 4;
         params.force_reset = false;
         int ret = init_ss_zns_device(&params, &this->_zns_dev);
         if (ret != 0)